@@ -14,6 +14,8 @@ as the full xts software, GPL (>= 2).
 #include <R.h>
 #include <Rinternals.h>
 #include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <stdint.h>
 
 #ifndef _XTS
 #define _XTS
@@ -70,12 +72,87 @@ SEXP mergeXts(SEXP args);
 SEXP do_rbind_xts(SEXP x, SEXP y, SEXP dup);
 SEXP rbindXts(SEXP args);
 SEXP do_subset_xts(SEXP x, SEXP sr, SEXP sc, SEXP drop);
+SEXP xts_row_index(SEXP i, SEXP nr);
+SEXP xts_expand_rows(SEXP rows);
+SEXP xts_assign_rows(SEXP x, SEXP sr, SEXP sc, SEXP value);
+SEXP xts_window_set(SEXP x, SEXP first, SEXP last, SEXP as_list);
+SEXP xts_event_windows(SEXP x, SEXP events, SEXP offsets, SEXP by_time);
+SEXP binsearch_many(SEXP keys, SEXP vec, SEXP start);
 SEXP number_of_cols(SEXP args);
 SEXP naCheck(SEXP x, SEXP check);
 
 SEXP make_index_unique(SEXP x, SEXP eps);
 SEXP make_unique(SEXP X, SEXP eps);
 SEXP endpoints(SEXP _x, SEXP _on, SEXP _k, SEXP _addlast);
+SEXP calendar_endpoints(SEXP _x, SEXP _on, SEXP _k, SEXP _tzoffsets);
+SEXP multi_endpoints(SEXP _x, SEXP _on, SEXP _k, SEXP _tzoffsets);
+SEXP endpoints_tracker(SEXP _on, SEXP _k, SEXP _tzoffsets);
+SEXP endpoints_tracker_update(SEXP _tracker, SEXP _x, SEXP _tzoffsets);
+SEXP bar_builder(SEXP _on, SEXP _k, SEXP _tzoffsets, SEXP _columns,
+                 SEXP _funs);
+SEXP bar_builder_update(SEXP _builder, SEXP _index, SEXP _x, SEXP _tzoffsets,
+                        SEXP _partial);
+SEXP to_period_list(SEXP _x, SEXP _on, SEXP _k, SEXP _tzoffsets,
+                    SEXP _specs);
+SEXP session_endpoints(SEXP _x, SEXP _day_start, SEXP _open, SEXP _close,
+                       SEXP _holidays, SEXP _tzoffsets);
+SEXP business_day_mask(SEXP _x, SEXP _weekmask, SEXP _holidays,
+                       SEXP _tzoffsets);
+SEXP business_day_count(SEXP _from, SEXP _to, SEXP _weekmask,
+                        SEXP _holidays);
+SEXP business_day_offset(SEXP _dates, SEXP _n, SEXP _roll, SEXP _weekmask,
+                         SEXP _holidays);
+SEXP business_endpoints(SEXP _x, SEXP _k, SEXP _weekmask, SEXP _holidays,
+                        SEXP _tzoffsets);
+SEXP activity_endpoints(SEXP _x, SEXP _price, SEXP _volume, SEXP _type,
+                        SEXP _threshold);
+SEXP index_fields(SEXP _x, SEXP _fields, SEXP _tzoffsets);
+SEXP tzif_offsets(SEXP _path, SEXP _to);
+
+/* civil date of a day since 1970-01-01, see calendar.c */
+#define XTS_CIVIL_WEEKDAY 1             /* Monday to Friday */
+struct civil_date {
+  int year;     /* e.g. 2024 */
+  int mon;      /* 1-12 */
+  int mday;     /* 1-31 */
+  int yday;     /* 0-365 */
+  int wday;     /* 0-6, Sunday is 0 */
+  int flags;    /* XTS_CIVIL_* */
+};
+void xts_civil_table_init(void);
+void xts_civil_date(int64_t day, struct civil_date *date);
+int64_t xts_days_from_civil(int64_t y, int m, int d);
+int xts_days_in_month(int64_t y, int m);
+SEXP start_of_year(SEXP _from, SEXP _to, SEXP _origin);
+SEXP days_in_month(SEXP _year, SEXP _month);
+SEXP civil_seconds(SEXP _year, SEXP _month, SEXP _day, SEXP _hour,
+                   SEXP _min, SEXP _sec);
+SEXP endpoints_int64(SEXP _x, SEXP _on, SEXP _k, SEXP _offset);
+int xts_is_integer64(SEXP x);
+SEXP int64_to_seconds(SEXP _x, SEXP _floor);
+SEXP int64_from_seconds(SEXP _x);
+void xts_check_integer64_indexes(SEXP xindex, SEXP yindex);
+
+/* compact index of a regular series: start + (first + i * by) * step */
+struct regular_index {
+  double start, step;
+  R_xlen_t n, first, by;
+};
+void xts_init_altrep(DllInfo *info);
+int xts_regular_index(SEXP x, struct regular_index *r);
+SEXP xts_new_regular_index(const struct regular_index *r);
+double xts_regular_value(const struct regular_index *r, R_xlen_t i);
+R_xlen_t xts_regular_lower(const struct regular_index *r, double key);
+R_xlen_t xts_regular_upper(const struct regular_index *r, double key);
+const double *xts_real_values(SEXP x);
+int xts_values_in_memory(SEXP x);
+SEXP compact_index(SEXP x);
+SEXP is_compact_index(SEXP x);
+void xts_init_packed_index(DllInfo *info);
+int xts_packed_index(SEXP x, int *strict);
+int xts_packed_search(SEXP x, double key, int use_start, int *result);
+SEXP pack_index(SEXP x);
+SEXP is_packed_index(SEXP x);
 SEXP do_merge_xts(SEXP x, SEXP y, SEXP all, SEXP fill, SEXP retclass, SEXP colnames, 
                   SEXP suffixes, SEXP retside, SEXP check_names, SEXP env, SEXP coerce);
 SEXP na_omit_xts(SEXP x);
@@ -87,10 +164,32 @@ SEXP xts_period_min(SEXP data, SEXP index);
 SEXP xts_period_max(SEXP data, SEXP index);
 SEXP xts_period_sum(SEXP data, SEXP index);
 SEXP xts_period_prod(SEXP data, SEXP index);
+SEXP period_aggregate(SEXP x, SEXP endpoints, SEXP columns, SEXP funs,
+                      SEXP first, SEXP colnames);
+
+/* aggregation functions of period_aggregate() and bar builders */
+enum { XTS_AGG_FIRST, XTS_AGG_LAST, XTS_AGG_MAX, XTS_AGG_MIN, XTS_AGG_SUM,
+       XTS_AGG_COUNT, XTS_AGG_MEAN, XTS_AGG_LAST_NONNA };
+struct xts_agg_state {
+  double first, last, max, min, last_nonna;
+  long double sum;
+  R_xlen_t count;     /* non-NA values */
+  R_xlen_t nobs;
+};
+int xts_aggregate_fun(const char *fun);
+int xts_aggregate_periods(const int *xi, const double *xr, R_xlen_t nrx,
+                          const int *ep, int n, int ncr, const int *col,
+                          const int *fun, int *result_int, double *result_real);
+void xts_agg_start(struct xts_agg_state *s, double v);
+void xts_agg_add(struct xts_agg_state *s, double v);
+double xts_agg_value(const struct xts_agg_state *s, int fun);
 
 SEXP xts_set_dimnames(SEXP x, SEXP value);
 
 
+void free_index_model(void);            // internal only
+void free_civil_table(void);            // internal only
+int xts_get_num_threads(void);          // internal only
 void copyAttributes(SEXP x, SEXP y);    // internal only
 void copy_xtsAttributes(SEXP x, SEXP y);    // internal only
 void copy_xtsCoreAttributes(SEXP x, SEXP y);// internal only    
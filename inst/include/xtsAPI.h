@@ -93,6 +93,45 @@ SEXP attribute_hidden xtsEndpoints(SEXP x, SEXP on, SEXP k, SEXP addlast) {
     return fun(x, on, k, addlast);
 }
 
+/*
+  Incremental endpoints. 'on' and 'k' are as in endpoints(), and 'tzoffsets'
+  is list(trans, offset) of UTC offset transitions (list(-Inf, 0) for UTC).
+  xtsEndpointsTrackerUpdate() returns the endpoints in the new index values
+  'x', as row numbers of the whole series. Pass R_NilValue as 'tzoffsets' to
+  keep using the previous table.
+*/
+SEXP attribute_hidden xtsEndpointsTracker(SEXP on, SEXP k, SEXP tzoffsets) {
+    static SEXP(*fun)(SEXP,SEXP,SEXP) =
+      (SEXP(*)(SEXP,SEXP,SEXP)) R_GetCCallable("xts","endpoints_tracker");
+    return fun(on, k, tzoffsets);
+}
+
+SEXP attribute_hidden xtsEndpointsTrackerUpdate(SEXP tracker, SEXP x, SEXP tzoffsets) {
+    static SEXP(*fun)(SEXP,SEXP,SEXP) =
+      (SEXP(*)(SEXP,SEXP,SEXP)) R_GetCCallable("xts","endpoints_tracker_update");
+    return fun(tracker, x, tzoffsets);
+}
+
+/*
+  Streaming bars. 'columns' (1-based) and 'funs' give the input column and
+  aggregation function ("first", "last", "max", "min", "sum", "count",
+  "mean", "last.nonNA") of each bar column. xtsBarBuilderUpdate() takes the
+  index and data matrix of the new observations and returns
+  list(index, data, partial) of the completed bars, plus the open bar when
+  'partial' is TRUE. Bars match to.period() on the whole series.
+*/
+SEXP attribute_hidden xtsBarBuilder(SEXP on, SEXP k, SEXP tzoffsets, SEXP columns, SEXP funs) {
+    static SEXP(*fun)(SEXP,SEXP,SEXP,SEXP,SEXP) =
+      (SEXP(*)(SEXP,SEXP,SEXP,SEXP,SEXP)) R_GetCCallable("xts","bar_builder");
+    return fun(on, k, tzoffsets, columns, funs);
+}
+
+SEXP attribute_hidden xtsBarBuilderUpdate(SEXP builder, SEXP index, SEXP x, SEXP tzoffsets, SEXP partial) {
+    static SEXP(*fun)(SEXP,SEXP,SEXP,SEXP,SEXP) =
+      (SEXP(*)(SEXP,SEXP,SEXP,SEXP,SEXP)) R_GetCCallable("xts","bar_builder_update");
+    return fun(builder, index, x, tzoffsets, partial);
+}
+
 SEXP attribute_hidden xtsMerge(SEXP x, SEXP y, SEXP all, SEXP fill, SEXP retclass, 
                                SEXP colnames, SEXP suffixes, SEXP retside, SEXP check_names,
                                SEXP env, SEXP coerce) {
@@ -0,0 +1,360 @@
+/*
+#   xts: eXtensible time-series
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Compact index for regular series.
+ *
+ * The index of a strictly regular series can be stored as an ALTREP double
+ * vector that only holds the parameters of
+ *
+ *   index[i] = start + (first + i * by) * step,   i = 0, ..., n-1
+ *
+ * where 'first' and 'by' describe the rows of the original series that the
+ * index refers to, so subsets of contiguous or evenly spaced rows have the
+ * exact same values as the original index. Searches and fixed-period
+ * endpoints use arithmetic on the parameters instead of the values.
+ *
+ * The values are only stored (in data2) when code asks for a pointer to
+ * them. A writeable pointer means the values may change, so the parameters
+ * are no longer used after that. Kernels that only read the index use
+ * xts_real_values(), which never stores the values.
+ *
+ * All values are computed by xts_regular_value(), so every kernel sees the
+ * same rounding.
+ */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#include <math.h>
+#include <string.h>
+#include "xts.h"
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+#define XTS_HAVE_ALTREP 1
+#include <R_ext/Altrep.h>
+#endif
+
+/* data1 layout */
+enum { RI_START, RI_STEP, RI_N, RI_FIRST, RI_BY, RI_VALID, RI_LENGTH };
+
+double xts_regular_value(const struct regular_index *r, R_xlen_t i)
+{
+  double pos = (double)(r->first + i * r->by);
+  return r->start + pos * r->step;
+}
+
+/* Smallest i with index[i] >= key, or n */
+R_xlen_t xts_regular_lower(const struct regular_index *r, double key)
+{
+  double pos = ((key - r->start) / r->step - (double)r->first) / (double)r->by;
+  R_xlen_t i;
+  if (!(pos > 0)) {
+    i = 0;
+  } else if (pos >= (double)r->n) {
+    i = r->n;
+  } else {
+    i = (R_xlen_t)ceil(pos);
+  }
+  /* the estimate can be off by rounding */
+  while (i > 0 && xts_regular_value(r, i - 1) >= key) i--;
+  while (i < r->n && xts_regular_value(r, i) < key) i++;
+  return i;
+}
+
+/* Largest i with index[i] <= key, or -1 */
+R_xlen_t xts_regular_upper(const struct regular_index *r, double key)
+{
+  double pos = ((key - r->start) / r->step - (double)r->first) / (double)r->by;
+  R_xlen_t i;
+  if (!(pos >= 0)) {
+    i = -1;
+  } else if (pos >= (double)(r->n - 1)) {
+    i = r->n - 1;
+  } else {
+    i = (R_xlen_t)floor(pos);
+  }
+  while (i + 1 < r->n && xts_regular_value(r, i + 1) <= key) i++;
+  while (i >= 0 && xts_regular_value(r, i) > key) i--;
+  return i;
+}
+
+#ifdef XTS_HAVE_ALTREP
+
+static R_altrep_class_t regular_index_class;
+
+static void regular_params(SEXP x, struct regular_index *r)
+{
+  const double *p = REAL(R_altrep_data1(x));
+  r->start = p[RI_START];
+  r->step = p[RI_STEP];
+  r->n = (R_xlen_t)p[RI_N];
+  r->first = (R_xlen_t)p[RI_FIRST];
+  r->by = (R_xlen_t)p[RI_BY];
+}
+
+static int regular_valid(SEXP x)
+{
+  return REAL(R_altrep_data1(x))[RI_VALID] != 0;
+}
+
+static SEXP regular_new(const struct regular_index *r)
+{
+  SEXP data1 = PROTECT(allocVector(REALSXP, RI_LENGTH));
+  double *p = REAL(data1);
+  p[RI_START] = r->start;
+  p[RI_STEP] = r->step;
+  p[RI_N] = (double)r->n;
+  p[RI_FIRST] = (double)r->first;
+  p[RI_BY] = (double)r->by;
+  p[RI_VALID] = 1;
+  SEXP x = R_new_altrep(regular_index_class, data1, R_NilValue);
+  UNPROTECT(1);
+  return x;
+}
+
+static R_xlen_t regular_Length(SEXP x)
+{
+  return (R_xlen_t)REAL(R_altrep_data1(x))[RI_N];
+}
+
+static double regular_Elt(SEXP x, R_xlen_t i)
+{
+  SEXP values = R_altrep_data2(x);
+  if (values != R_NilValue) return REAL(values)[i];
+  struct regular_index r;
+  regular_params(x, &r);
+  return xts_regular_value(&r, i);
+}
+
+static R_xlen_t
+regular_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf)
+{
+  R_xlen_t len = regular_Length(x);
+  if (i + n > len) n = len - i;
+  SEXP values = R_altrep_data2(x);
+  if (values != R_NilValue) {
+    memcpy(buf, REAL(values) + i, n * sizeof(double));
+    return n;
+  }
+  struct regular_index r;
+  regular_params(x, &r);
+  for (R_xlen_t k = 0; k < n; k++) {
+    buf[k] = xts_regular_value(&r, i + k);
+  }
+  return n;
+}
+
+static void *regular_Dataptr(SEXP x, Rboolean writeable)
+{
+  SEXP values = R_altrep_data2(x);
+  if (values == R_NilValue) {
+    R_xlen_t n = regular_Length(x);
+    values = PROTECT(allocVector(REALSXP, n));
+    regular_Get_region(x, 0, n, REAL(values));
+    R_set_altrep_data2(x, values);
+    UNPROTECT(1);
+  }
+  /* the caller may change the values */
+  if (writeable) REAL(R_altrep_data1(x))[RI_VALID] = 0;
+  return REAL(values);
+}
+
+static const void *regular_Dataptr_or_null(SEXP x)
+{
+  SEXP values = R_altrep_data2(x);
+  return (values == R_NilValue) ? NULL : REAL(values);
+}
+
+static int regular_Is_sorted(SEXP x)
+{
+  return regular_valid(x) ? SORTED_INCR : UNKNOWN_SORTEDNESS;
+}
+
+static int regular_No_NA(SEXP x)
+{
+  return regular_valid(x);
+}
+
+static SEXP regular_Duplicate(SEXP x, Rboolean deep)
+{
+  /* NULL uses the default method, which copies the values */
+  if (!regular_valid(x)) return NULL;
+  struct regular_index r;
+  regular_params(x, &r);
+  return regular_new(&r);
+}
+
+static SEXP regular_Serialized_state(SEXP x)
+{
+  /* the values are serialized like an ordinary vector, so saved objects
+   * can be read by sessions that don't have this class (e.g. other xts
+   * versions) */
+  return NULL;
+}
+
+/* only reads objects that were saved with their parameters */
+static SEXP regular_Unserialize(SEXP cls, SEXP state)
+{
+  struct regular_index r;
+  const double *p = REAL(state);
+  r.start = p[RI_START];
+  r.step = p[RI_STEP];
+  r.n = (R_xlen_t)p[RI_N];
+  r.first = (R_xlen_t)p[RI_FIRST];
+  r.by = (R_xlen_t)p[RI_BY];
+  return regular_new(&r);
+}
+
+static Rboolean
+regular_Inspect(SEXP x, int pre, int deep, int pvec,
+                void (*inspect_subtree)(SEXP, int, int, int))
+{
+  struct regular_index r;
+  regular_params(x, &r);
+  Rprintf(" xts regular index (start=%.15g, step=%.15g, n=%.0f%s)\n",
+          xts_regular_value(&r, 0), r.step * (double)r.by, (double)r.n,
+          regular_valid(x) ? "" : ", modified");
+  return TRUE;
+}
+
+void xts_init_altrep(DllInfo *info)
+{
+  regular_index_class = R_make_altreal_class("xts_regular_index", "xts", info);
+  R_altrep_class_t cls = regular_index_class;
+  R_set_altrep_Length_method(cls, regular_Length);
+  R_set_altrep_Duplicate_method(cls, regular_Duplicate);
+  R_set_altrep_Serialized_state_method(cls, regular_Serialized_state);
+  R_set_altrep_Unserialize_method(cls, regular_Unserialize);
+  R_set_altrep_Inspect_method(cls, regular_Inspect);
+  R_set_altvec_Dataptr_method(cls, regular_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, regular_Dataptr_or_null);
+  R_set_altreal_Elt_method(cls, regular_Elt);
+  R_set_altreal_Get_region_method(cls, regular_Get_region);
+  R_set_altreal_Is_sorted_method(cls, regular_Is_sorted);
+  R_set_altreal_No_NA_method(cls, regular_No_NA);
+}
+
+int xts_regular_index(SEXP x, struct regular_index *r)
+{
+  if (!ALTREP(x) || !R_altrep_inherits(x, regular_index_class) ||
+      !regular_valid(x))
+    return 0;
+  regular_params(x, r);
+  return 1;
+}
+
+SEXP xts_new_regular_index(const struct regular_index *r)
+{
+  return regular_new(r);
+}
+
+const double *xts_real_values(SEXP x)
+{
+  if (ALTREP(x)) {
+    const double *values = (const double *) DATAPTR_OR_NULL(x);
+    if (values != NULL) return values;
+    R_xlen_t n = xlength(x);
+    double *buf = (double *) R_alloc(n, sizeof(double));
+    REAL_GET_REGION(x, 0, n, buf);
+    return buf;
+  }
+  return REAL(x);
+}
+
+/* FALSE for ALTREP vectors that compute their values on request */
+int xts_values_in_memory(SEXP x)
+{
+  return !ALTREP(x) || DATAPTR_OR_NULL(x) != NULL;
+}
+
+#else /* no ALTREP */
+
+void xts_init_altrep(DllInfo *info)
+{
+}
+
+int xts_regular_index(SEXP x, struct regular_index *r)
+{
+  return 0;
+}
+
+SEXP xts_new_regular_index(const struct regular_index *r)
+{
+  return R_NilValue;
+}
+
+const double *xts_real_values(SEXP x)
+{
+  return REAL(x);
+}
+
+int xts_values_in_memory(SEXP x)
+{
+  return 1;
+}
+
+#endif
+
+/* The index 'x', stored as a compact regular index if its values are
+ * exactly start + i * step. Other indexes are returned unchanged. */
+SEXP compact_index(SEXP x)
+{
+  struct regular_index r;
+  R_xlen_t i, n = xlength(x);
+
+  if (TYPEOF(x) != REALSXP || n < 2 || xts_is_integer64(x) ||
+      xts_regular_index(x, &r))
+    return x;
+
+  const double *v = xts_real_values(x);
+  r.start = v[0];
+  r.n = n;
+  r.first = 0;
+  r.by = 1;
+
+  /* try the first difference, the average difference, and the average
+   * difference rounded to nanoseconds (differences of large values like
+   * POSIXct times are not exact) */
+  double avg = (v[n - 1] - v[0]) / (double)(n - 1);
+  double steps[3] = { v[1] - v[0], avg, nearbyint(avg * 1e9) / 1e9 };
+  for (int s = 0; s < 3; s++) {
+    r.step = steps[s];
+    if (!R_FINITE(r.start) || !R_FINITE(r.step) || !(r.step > 0))
+      continue;
+    for (i = 0; i < n; i++) {
+      if (v[i] != xts_regular_value(&r, i)) break;
+    }
+    if (i == n) {
+      SEXP result = xts_new_regular_index(&r);
+      if (result == R_NilValue) return x;
+      PROTECT(result);
+      SHALLOW_DUPLICATE_ATTRIB(result, x);
+      UNPROTECT(1);
+      return result;
+    }
+  }
+  return x;
+}
+
+/* TRUE if 'x' is a compact regular index */
+SEXP is_compact_index(SEXP x)
+{
+  struct regular_index r;
+  return ScalarLogical(xts_regular_index(x, &r));
+}
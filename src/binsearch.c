@@ -23,6 +23,9 @@
 #include <R.h>
 #include <Rinternals.h>
 #include <Rmath.h>
+#include <limits.h>
+#include <stdint.h>
+#include "xts.h"
 
 /* Binary search range to find interval written by Corwin Joy, with
  * contributions by Joshua Ulrich
@@ -33,6 +36,8 @@ struct keyvec {
   double dkey;
   int *ivec;
   int ikey;
+  int64_t *lvec;  /* nanosecond (integer64) index, see int64.c */
+  int64_t lkey;
 };
 
 /* Predicate function definition and functions to determine which of the
@@ -69,6 +74,291 @@ cmp_int_lower(const struct keyvec kv, const int i)
   return cv >= ck;
 }
 
+static inline int
+cmp_i64_upper(const struct keyvec kv, const int i)
+{
+  const int64_t cv = kv.lvec[i];
+  const int64_t ck = kv.lkey;
+  return cv > ck;
+}
+static inline int
+cmp_i64_lower(const struct keyvec kv, const int i)
+{
+  const int64_t cv = kv.lvec[i];
+  const int64_t ck = kv.lkey;
+  return cv >= ck;
+}
+
+/* Smallest index in [lo, hi] where cmp_func() is true. Returns 'hi' if
+ * cmp_func() is not true for any element in [lo, hi), so the caller must
+ * check whether cmp_func() is true at the returned index.
+ */
+static int
+bisect(bound_comparer cmp_func, const struct keyvec data, int lo, int hi)
+{
+  int mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (cmp_func(data, mid)) {
+      hi = mid;
+    }
+    else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+/* Same as bisect(), but start from a 'guess' and probe outward in steps of
+ * 1, 2, 4, ... until the answer is bracketed, then bisect the bracket. This
+ * costs O(log(d)) probes, where 'd' is the distance between the guess and
+ * the answer, so it's very fast when the guess is good.
+ */
+static int
+gallop(bound_comparer cmp_func, const struct keyvec data, int lo, int hi,
+       int guess)
+{
+  R_xlen_t probe, step = 1;
+
+  if (guess < lo) guess = lo;
+  if (guess > hi) guess = hi;
+
+  if (cmp_func(data, guess)) {
+    hi = guess;
+    probe = hi - 1;
+    while (probe >= lo) {
+      if (!cmp_func(data, probe)) {
+        lo = probe + 1;
+        break;
+      }
+      hi = probe;
+      step *= 2;
+      probe = hi - step;
+    }
+  } else {
+    if (guess == hi) {
+      return hi;
+    }
+    lo = guess + 1;
+    probe = lo;
+    while (probe < hi) {
+      if (cmp_func(data, probe)) {
+        hi = probe;
+        break;
+      }
+      lo = probe + 1;
+      step *= 2;
+      probe = lo + step - 1;
+    }
+  }
+  return bisect(cmp_func, data, lo, hi);
+}
+
+/* Piecewise-linear model of a sorted vector (a "learned index"). The vector
+ * is split into segments of 'seglen' elements and the value at each segment
+ * boundary (a knot) is stored, along with a flag for whether the values in
+ * the segment are close to a straight line between its knots.
+ *
+ * A search first finds the segment via the knots (which are small and stay
+ * in cache), then interpolates the position of the key within the segment
+ * and gallops to the answer. Segments that aren't near-linear fall back to
+ * bisection.
+ *
+ * The model is built once and cached for the most recently modelled vector.
+ * Building it reads about 2 * nseg values, while bisection reads about
+ * log2(n), so a single search of a fresh vector (e.g. one x["2020-01"])
+ * would be slower with a model. The model is only built once the searches
+ * of the same vector have read as many values as the build will, so the
+ * total cost is at most about twice that of bisection, even when searches
+ * alternate between vectors.
+ *
+ * The model is only a hint: every bracket it provides is verified against
+ * the vector itself, so a stale model can't cause wrong results.
+ */
+#define MODEL_MIN_LENGTH    4096   /* shorter vectors use bisection */
+#define MODEL_MIN_SEGLEN    64     /* minimum elements per segment */
+#define MODEL_MAX_SEGMENTS  65536  /* maximum number of segments */
+#define MODEL_MAX_ERROR     4      /* max interpolation error (elements) */
+
+struct index_model {
+  SEXP vec;           /* vector the model was built for */
+  int n;              /* length of 'vec' */
+  double first;       /* vec[0] */
+  double last;        /* vec[n-1] */
+  int seglen;         /* elements per segment */
+  int nseg;           /* number of segments */
+  double *knot;       /* vec[k*seglen], k = 0..nseg (last knot is vec[n-1]) */
+  char *linear;       /* is segment k near-linear? */
+};
+
+static struct index_model index_model_cache = { NULL, 0, 0, 0, 0, 0, NULL, NULL };
+
+/* searches of the most recently searched vector without a model */
+static struct {
+  SEXP vec;
+  int n;
+  double first;
+  double last;
+  double searches;
+} index_model_demand = { NULL, 0, 0, 0, 0 };
+
+static inline double
+keyvec_value(const struct keyvec kv, const int i)
+{
+  if (kv.lvec != NULL) return (double)kv.lvec[i];
+  return (kv.dvec != NULL) ? kv.dvec[i] : (double)kv.ivec[i];
+}
+
+static inline int
+knot_position(const struct index_model *m, const int k)
+{
+  R_xlen_t pos = (R_xlen_t)k * m->seglen;
+  return (pos < m->n) ? (int)pos : m->n - 1;
+}
+
+void
+free_index_model(void)
+{
+  struct index_model *m = &index_model_cache;
+  free(m->knot);
+  free(m->linear);
+  m->vec = NULL;
+  m->n = 0;
+  m->knot = NULL;
+  m->linear = NULL;
+}
+
+static struct index_model *
+get_index_model(SEXP vec, const struct keyvec data)
+{
+  struct index_model *m = &index_model_cache;
+  int n = length(vec);
+  double first = keyvec_value(data, 0), last = keyvec_value(data, n-1);
+
+  if (m->vec == vec && m->n == n && m->first == first && m->last == last) {
+    return m;
+  }
+
+  int k, seglen = (n - 1) / MODEL_MAX_SEGMENTS + 1;
+  if (seglen < MODEL_MIN_SEGLEN) {
+    seglen = MODEL_MIN_SEGLEN;
+  }
+  int nseg = (n - 2) / seglen + 1;  /* ceiling((n - 1) / seglen) */
+
+  /* bisect until the model pays for itself */
+  if (index_model_demand.vec == vec && index_model_demand.n == n &&
+      index_model_demand.first == first && index_model_demand.last == last) {
+    index_model_demand.searches++;
+  } else {
+    index_model_demand.vec = vec;
+    index_model_demand.n = n;
+    index_model_demand.first = first;
+    index_model_demand.last = last;
+    index_model_demand.searches = 1;
+  }
+  if (index_model_demand.searches * log2((double)n) < 2.0 * nseg) {
+    return NULL;
+  }
+  index_model_demand.vec = NULL;
+
+  free_index_model();
+  m->knot = (double *) malloc((nseg + 1) * sizeof(double));
+  m->linear = (char *) malloc(nseg * sizeof(char));
+  if (m->knot == NULL || m->linear == NULL) {
+    free_index_model();
+    return NULL;
+  }
+  m->seglen = seglen;
+  m->nseg = nseg;
+  m->n = n;
+
+  for (k = 0; k <= nseg; k++) {
+    m->knot[k] = keyvec_value(data, knot_position(m, k));
+  }
+
+  /* check the middle of each segment against a straight line between the
+   * segment's knots, and only use interpolation if it's close
+   */
+  for (k = 0; k < nseg; k++) {
+    int a = knot_position(m, k);
+    int b = knot_position(m, k + 1);
+    int mid = a + (b - a) / 2;
+    double va = m->knot[k];
+    double vb = m->knot[k + 1];
+    double vm = keyvec_value(data, mid);
+
+    m->linear[k] = 0;
+    if (R_FINITE(va) && R_FINITE(vb) && R_FINITE(vm) && vb > va) {
+      double pred = a + (vm - va) / (vb - va) * (b - a);
+      m->linear[k] = fabs(pred - mid) <= MODEL_MAX_ERROR;
+    }
+  }
+
+  m->first = m->knot[0];
+  m->last = m->knot[nseg];
+  m->vec = vec;
+
+  return m;
+}
+
+/* Same contract as bisect() over the entire vector, but use the model to
+ * narrow the search to one segment first.
+ */
+static int
+model_search(const struct index_model *m, bound_comparer cmp_func,
+             const struct keyvec data, const double key, const int use_start)
+{
+  int n = m->n;
+
+  /* first knot where the predicate is true */
+  int lo = 0, hi = m->nseg, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if ((use_start) ? m->knot[mid] >= key : m->knot[mid] > key) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  int k = lo;
+
+  int seg_hi = knot_position(m, k);
+  if (k == 0) {
+    return (cmp_func(data, 0)) ? 0 : bisect(cmp_func, data, 0, n - 1);
+  }
+  int seg_lo = knot_position(m, k - 1);
+
+  /* verify the bracket against the data, in case the model is stale */
+  if (cmp_func(data, seg_lo) ||
+      (seg_hi != n - 1 && !cmp_func(data, seg_hi))) {
+    return bisect(cmp_func, data, 0, n - 1);
+  }
+
+  if (!m->linear[k - 1]) {
+    return bisect(cmp_func, data, seg_lo + 1, seg_hi);
+  }
+
+  double vlo = keyvec_value(data, seg_lo);
+  double vhi = keyvec_value(data, seg_hi);
+  double guess = seg_lo + 1;
+  if (vhi > vlo) {
+    guess = seg_lo + (key - vlo) / (vhi - vlo) * (seg_hi - seg_lo);
+    if (!(guess >= seg_lo + 1)) guess = seg_lo + 1;  /* also catches NaN */
+    if (guess > seg_hi) guess = seg_hi;
+  }
+  return gallop(cmp_func, data, seg_lo + 1, seg_hi, (int)guess);
+}
+
+/* binsearch() on a compact regular index, without reading its values */
+static int
+regular_search(const struct regular_index *r, const double key,
+               const int use_start)
+{
+  R_xlen_t i = (use_start) ? xts_regular_lower(r, key)
+                           : xts_regular_upper(r, key);
+  return (i < 0 || i >= r->n) ? NA_INTEGER : (int)(i + 1);
+}
+
 /* Binary search function */
 SEXP binsearch(SEXP key, SEXP vec, SEXP start)
 {
@@ -82,16 +372,38 @@ SEXP binsearch(SEXP key, SEXP vec, SEXP start)
 
   int use_start = LOGICAL(start)[0];
   bound_comparer cmp_func = NULL;
-  struct keyvec data;
+  struct keyvec data = { NULL, 0, NULL, 0, NULL, 0 };
+  struct regular_index regular;
+  int found;
+  double dkey;
 
-  switch (TYPEOF(vec)) {
+  if (xts_is_integer64(vec)) {
+    /* the key is converted to nanoseconds by binsearch() in R */
+    if (!xts_is_integer64(key)) {
+      error("'key' must be integer64 when 'vec' is integer64");
+    }
+    data.lkey = ((int64_t *) REAL(key))[0];
+    data.lvec = (int64_t *) REAL(vec);
+    cmp_func = (use_start) ? cmp_i64_lower : cmp_i64_upper;
+    if (INT64_MIN == data.lkey) {
+      return ScalarInteger(NA_INTEGER);
+    }
+    dkey = (double)data.lkey;
+  } else switch (TYPEOF(vec)) {
     case REALSXP:
       data.dkey = REAL(key)[0];
-      data.dvec = REAL(vec);
-      cmp_func = (use_start) ? cmp_dbl_lower : cmp_dbl_upper;
       if (!R_finite(data.dkey)) {
         return ScalarInteger(NA_INTEGER);
       }
+      if (xts_regular_index(vec, &regular)) {
+        return ScalarInteger(regular_search(&regular, data.dkey, use_start));
+      }
+      if (xts_packed_search(vec, data.dkey, use_start, &found)) {
+        return ScalarInteger(found);
+      }
+      data.dvec = REAL(vec);
+      cmp_func = (use_start) ? cmp_dbl_lower : cmp_dbl_upper;
+      dkey = data.dkey;
       break;
     case INTSXP:
       data.ikey = INTEGER(key)[0];
@@ -100,23 +412,24 @@ SEXP binsearch(SEXP key, SEXP vec, SEXP start)
       if (NA_INTEGER == data.ikey) {
         return ScalarInteger(NA_INTEGER);
       }
+      dkey = (double)data.ikey;
       break;
     default:
       error("unsupported type");
   }
 
-  int mid;
-  int lo = 0;
-  int hi = length(vec) - 1;
+  int lo;
+  int n = length(vec);
+  struct index_model *model = NULL;
 
-  while (lo < hi) {
-    mid = lo + (hi - lo) / 2;
-    if (cmp_func(data, mid)) {
-      hi = mid;
-    }
-    else {
-      lo = mid + 1;
-    }
+  if (n >= MODEL_MIN_LENGTH) {
+    model = get_index_model(vec, data);
+  }
+
+  if (model != NULL) {
+    lo = model_search(model, cmp_func, data, dkey, use_start);
+  } else {
+    lo = bisect(cmp_func, data, 0, n - 1);
   }
 
   /* 'lo' contains the smallest index where cmp_func() is true, but we need
@@ -152,6 +465,172 @@ SEXP binsearch(SEXP key, SEXP vec, SEXP start)
   return ScalarInteger(lo);
 }
 
+/* Vectorized binsearch(). The result for each element of 'keys' is the same
+ * as binsearch(keys[i], vec, start), but the keys are sorted first and each
+ * search gallops forward from the result for the previous key. So all the
+ * keys are located in one sweep over 'vec', instead of one full binary
+ * search per key. Non-finite and NA keys return NA.
+ */
+SEXP binsearch_many(SEXP keys, SEXP vec, SEXP start)
+{
+  if (!isLogical(start)) {
+    error("start must be specified as true or false");
+  }
+
+  int i, k, m = length(keys), n = length(vec);
+  int use_start = LOGICAL(start)[0];
+
+  SEXP result = PROTECT(allocVector(INTSXP, m));
+  int *res = INTEGER(result);
+  for (i = 0; i < m; i++) {
+    res[i] = NA_INTEGER;
+  }
+  if (n < 1 || m < 1) {
+    UNPROTECT(1);
+    return result;
+  }
+
+  bound_comparer cmp_func = NULL;
+  struct keyvec data = { NULL, 0, NULL, 0, NULL, 0 };
+  struct regular_index regular;
+  int is_regular = 0, is_packed = 0;
+
+  if (xts_is_integer64(vec)) {
+    if (!xts_is_integer64(keys)) {
+      error("'keys' must be integer64 when 'vec' is integer64");
+    }
+    data.lvec = (int64_t *) REAL(vec);
+    cmp_func = (use_start) ? cmp_i64_lower : cmp_i64_upper;
+  } else switch (TYPEOF(vec)) {
+    case REALSXP:
+      is_regular = xts_regular_index(vec, &regular);
+      is_packed = !is_regular && xts_packed_index(vec, NULL);
+      if (!is_regular && !is_packed) {
+        data.dvec = REAL(vec);
+      }
+      cmp_func = (use_start) ? cmp_dbl_lower : cmp_dbl_upper;
+      break;
+    case INTSXP:
+      data.ivec = INTEGER(vec);
+      cmp_func = (use_start) ? cmp_int_lower : cmp_int_upper;
+      break;
+    default:
+      error("unsupported type");
+  }
+
+  /* sort the valid keys, keeping track of their original positions */
+  double *dkeys = (double *) R_alloc(m, sizeof(double));
+  int *pos = (int *) R_alloc(m, sizeof(int));
+  int nkeys = 0;
+
+  const int64_t *int64_keys = NULL;
+
+  if (data.lvec) {
+    /* sorted by their (rounded) double values first, then exactly below */
+    int64_keys = (const int64_t *) REAL(keys);
+    for (i = 0; i < m; i++) {
+      if (int64_keys[i] != INT64_MIN) {
+        dkeys[nkeys] = (double)int64_keys[i];
+        pos[nkeys++] = i;
+      }
+    }
+  } else switch (TYPEOF(keys)) {
+    case REALSXP:
+      {
+        double *real_keys = REAL(keys);
+        for (i = 0; i < m; i++) {
+          if (R_finite(real_keys[i])) {
+            dkeys[nkeys] = real_keys[i];
+            pos[nkeys++] = i;
+          }
+        }
+      }
+      break;
+    case INTSXP:
+      {
+        int *int_keys = INTEGER(keys);
+        for (i = 0; i < m; i++) {
+          if (int_keys[i] != NA_INTEGER) {
+            dkeys[nkeys] = int_keys[i];
+            pos[nkeys++] = i;
+          }
+        }
+      }
+      break;
+    default:
+      error("unsupported type");
+  }
+
+  if (is_regular) {
+    /* each key is located arithmetically, so they don't need sorting */
+    for (k = 0; k < nkeys; k++) {
+      res[pos[k]] = regular_search(&regular, dkeys[k], use_start);
+    }
+    UNPROTECT(1);
+    return result;
+  }
+  if (is_packed) {
+    /* each key decodes one block of the packed index */
+    for (k = 0; k < nkeys; k++) {
+      xts_packed_search(vec, dkeys[k], use_start, &res[pos[k]]);
+    }
+    UNPROTECT(1);
+    return result;
+  }
+
+  if (nkeys > 1) {
+    R_qsort_I(dkeys, pos, 1, nkeys);
+  }
+  if (int64_keys) {
+    /* keys that round to the same double may be out of order */
+    for (i = 1; i < nkeys; i++) {
+      int p = pos[i];
+      for (k = i; k > 0 && int64_keys[pos[k - 1]] > int64_keys[p]; k--) {
+        pos[k] = pos[k - 1];
+      }
+      pos[k] = p;
+    }
+  }
+
+  int lo = 0;
+  for (k = 0; k < nkeys; k++) {
+    if (data.lvec) {
+      data.lkey = int64_keys[pos[k]];
+    } else if (data.dvec) {
+      data.dkey = dkeys[k];
+    } else {
+      /* integer 'vec' and (possibly) fractional key: vec >= key is the same
+       * as vec >= ceil(key), and vec > key the same as vec > floor(key) */
+      double dkey = (use_start) ? ceil(dkeys[k]) : floor(dkeys[k]);
+      if (dkey > INT_MAX) dkey = INT_MAX;
+      if (dkey < -INT_MAX) dkey = -INT_MAX;
+      data.ikey = (int) dkey;
+    }
+
+    /* the answer can't be before the answer for the previous (smaller) key */
+    lo = gallop(cmp_func, data, lo, n - 1, lo);
+
+    /* same edge cases as binsearch() */
+    int found = lo;
+    if (use_start) {
+      if (!cmp_func(data, n - 1)) {
+        continue;
+      }
+    } else {
+      if (cmp_func(data, found)) {
+        found--;
+        if (found < 0) {
+          continue;
+        }
+      }
+    }
+    res[pos[k]] = found + 1;
+  }
+
+  UNPROTECT(1);
+  return result;
+}
+
 SEXP fill_window_dups_rev(SEXP _x, SEXP _index)
 {
   /* Translate user index (_x) to xts index (_index). '_x' contains the
@@ -0,0 +1,305 @@
+/*
+#   xts: eXtensible time-series
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Civil calendar table.
+ *
+ * Calendar kernels (calendar endpoints, index fields, startOfYear(),
+ * firstof() and lastof()) work with days since 1970-01-01. The civil date,
+ * day of the year, day of the week and business-day flag of every day in
+ * the years of getOption("xts.calendar.years") (1900 to 2200 by default)
+ * are stored in a table, along with the first day of every month, so they
+ * are lookups. Days outside the table use H. Hinnant's "chrono-compatible
+ * low-level date algorithms", so results never depend on the range.
+ *
+ * The table is built, or rebuilt when the option changes, by
+ * xts_civil_table_init(). It must be called from the main thread before
+ * entering a parallel region; lookups are thread-safe.
+ */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "xts.h"
+
+#define CIVIL_DEFAULT_FROM 1900
+#define CIVIL_DEFAULT_TO   2200
+#define CIVIL_MIN_YEAR     0
+#define CIVIL_MAX_YEAR     9999
+
+struct civil_day {
+  int16_t year;
+  uint8_t mon;      /* 1-12 */
+  uint8_t mday;     /* 1-31 */
+  uint16_t yday;    /* 0-365 */
+  uint8_t wday;     /* 0-6, Sunday is 0 */
+  uint8_t flags;    /* XTS_CIVIL_* */
+};
+
+static struct {
+  int from, to;             /* years in the table, empty when from > to */
+  int64_t first;            /* day of from-01-01 */
+  int64_t ndays;
+  struct civil_day *day;
+  int64_t *month_start;     /* day of the first of each month, and of
+                               (to+1)-01-01 */
+} civil_table = { 1, 0, 0, 0, NULL, NULL };
+
+static int64_t hinnant_days_from_civil(int64_t y, int m, int d)
+{
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+static void hinnant_civil_from_days(int64_t z, int64_t *y, int *m, int *d)
+{
+  z += 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  int64_t doe = z - era * 146097;
+  int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  int64_t mp = (5 * doy + 2) / 153;
+  *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+  *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+/* 1970-01-01 was a Thursday */
+static int wday_of(int64_t day)
+{
+  return (int)((day % 7 + 11) % 7);
+}
+
+static int weekday_flags(int wday)
+{
+  return (wday > 0 && wday < 6) ? XTS_CIVIL_WEEKDAY : 0;
+}
+
+void free_civil_table(void)
+{
+  free(civil_table.day);
+  free(civil_table.month_start);
+  civil_table.day = NULL;
+  civil_table.month_start = NULL;
+  civil_table.from = 1;
+  civil_table.to = 0;
+  civil_table.ndays = 0;
+}
+
+static void civil_table_build(int from, int to)
+{
+  int nyears = to - from + 1;
+  int64_t first = hinnant_days_from_civil(from, 1, 1);
+  int64_t ndays = hinnant_days_from_civil((int64_t)to + 1, 1, 1) - first;
+
+  free_civil_table();
+  civil_table.day = (struct civil_day *) malloc(ndays * sizeof(struct civil_day));
+  civil_table.month_start = (int64_t *) malloc((nyears * 12 + 1) * sizeof(int64_t));
+  if (civil_table.day == NULL || civil_table.month_start == NULL) {
+    /* lookups fall back to arithmetic */
+    free_civil_table();
+    return;
+  }
+
+  struct civil_day *p = civil_table.day;
+  int64_t day = first;
+  for (int y = from; y <= to; y++) {
+    int yday = 0;
+    for (int m = 1; m <= 12; m++) {
+      civil_table.month_start[(y - from) * 12 + m - 1] = day;
+      int mdays = xts_days_in_month(y, m);
+      for (int d = 1; d <= mdays; d++, day++, yday++, p++) {
+        p->year = (int16_t)y;
+        p->mon = (uint8_t)m;
+        p->mday = (uint8_t)d;
+        p->yday = (uint16_t)yday;
+        p->wday = (uint8_t)wday_of(day);
+        p->flags = (uint8_t)weekday_flags(p->wday);
+      }
+    }
+  }
+  civil_table.month_start[nyears * 12] = day;
+
+  civil_table.from = from;
+  civil_table.to = to;
+  civil_table.first = first;
+  civil_table.ndays = ndays;
+}
+
+void xts_civil_table_init(void)
+{
+  int from = CIVIL_DEFAULT_FROM, to = CIVIL_DEFAULT_TO;
+  SEXP opt = GetOption1(install("xts.calendar.years"));
+  if (!isNull(opt)) {
+    if (!isNumeric(opt) || length(opt) != 2)
+      error("'xts.calendar.years' option must be a numeric vector of length 2");
+    /* coercion gives NA for NA and out-of-range years */
+    SEXP years = PROTECT(coerceVector(opt, INTSXP));
+    from = INTEGER(years)[0];
+    to = INTEGER(years)[1];
+    UNPROTECT(1);
+    if (from == NA_INTEGER || to == NA_INTEGER || from > to ||
+        from < CIVIL_MIN_YEAR || to > CIVIL_MAX_YEAR)
+      error("'xts.calendar.years' must be increasing years between %d and %d",
+            CIVIL_MIN_YEAR, CIVIL_MAX_YEAR);
+  }
+  if (from != civil_table.from || to != civil_table.to ||
+      civil_table.day == NULL) {
+    civil_table_build(from, to);
+  }
+}
+
+int xts_days_in_month(int64_t y, int m)
+{
+  static const int mdays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+  if (m == 2 && ((y % 4 == 0 && y % 100 != 0) || y % 400 == 0))
+    return 29;
+  return mdays[m - 1];
+}
+
+/* Days since 1970-01-01 of y-m-d, for m in 1..13 (13 is January of the
+ * next year) and any d */
+int64_t xts_days_from_civil(int64_t y, int m, int d)
+{
+  if (y >= civil_table.from && y <= civil_table.to) {
+    return civil_table.month_start[(y - civil_table.from) * 12 + m - 1] + d - 1;
+  }
+  if (m == 13) {
+    y++;
+    m = 1;
+  }
+  return hinnant_days_from_civil(y, m, d);
+}
+
+void xts_civil_date(int64_t day, struct civil_date *date)
+{
+  int64_t i = day - civil_table.first;
+  if (i >= 0 && i < civil_table.ndays) {
+    const struct civil_day *p = civil_table.day + i;
+    date->year = p->year;
+    date->mon = p->mon;
+    date->mday = p->mday;
+    date->yday = p->yday;
+    date->wday = p->wday;
+    date->flags = p->flags;
+    return;
+  }
+  int64_t y;
+  int m, d;
+  hinnant_civil_from_days(day, &y, &m, &d);
+  date->year = (int)y;
+  date->mon = m;
+  date->mday = d;
+  date->yday = (int)(day - hinnant_days_from_civil(y, 1, 1));
+  date->wday = wday_of(day);
+  date->flags = weekday_flags(date->wday);
+}
+
+/* Days from origin-01-01 to the first of January of each year in from:to,
+ * which replaces do_startofyear() */
+SEXP start_of_year(SEXP _from, SEXP _to, SEXP _origin)
+{
+  int from = asInteger(_from), to = asInteger(_to), origin = asInteger(_origin);
+  if (from == NA_INTEGER || to == NA_INTEGER || origin == NA_INTEGER)
+    error("'from', 'to' and 'origin' must not be NA");
+  if (from > to) error("'from' must not be after 'to'");
+
+  xts_civil_table_init();
+
+  SEXP _result = PROTECT(allocVector(INTSXP, (R_xlen_t)to - from + 1));
+  int *result = INTEGER(_result);
+  int64_t zero = xts_days_from_civil(origin, 1, 1);
+  for (int y = from; y <= to; y++) {
+    result[y - from] = (int)(xts_days_from_civil(y, 1, 1) - zero);
+  }
+  UNPROTECT(1);
+  return _result;
+}
+
+/* Number of days in each month, recycling 'year' and 'month'. NA when the
+ * month is not in 1..12. */
+SEXP days_in_month(SEXP _year, SEXP _month)
+{
+  int P = 0;
+  PROTECT(_year = coerceVector(_year, INTSXP)); P++;
+  PROTECT(_month = coerceVector(_month, INTSXP)); P++;
+  R_xlen_t ny = xlength(_year), nm = xlength(_month);
+  R_xlen_t i, n = (ny == 0 || nm == 0) ? 0 : (ny > nm ? ny : nm);
+  const int *year = INTEGER(_year), *month = INTEGER(_month);
+
+  SEXP _result = PROTECT(allocVector(INTSXP, n)); P++;
+  int *result = INTEGER(_result);
+  for (i = 0; i < n; i++) {
+    int y = year[i % ny], m = month[i % nm];
+    result[i] = (y == NA_INTEGER || m == NA_INTEGER || m < 1 || m > 12)
+              ? NA_INTEGER : xts_days_in_month(y, m);
+  }
+  UNPROTECT(P);
+  return _result;
+}
+
+/* Seconds since the epoch of the UTC date-times year-month-day
+ * hour:min:sec, recycling the arguments like ISOdatetime(). Values that
+ * ISOdatetime() would not parse are NA. */
+SEXP civil_seconds(SEXP _year, SEXP _month, SEXP _day, SEXP _hour,
+                   SEXP _min, SEXP _sec)
+{
+  int P = 0;
+  SEXP args[6] = { _year, _month, _day, _hour, _min, _sec };
+  const double *v[6];
+  R_xlen_t len[6], i, n = 0;
+
+  for (int a = 0; a < 6; a++) {
+    PROTECT(args[a] = coerceVector(args[a], REALSXP)); P++;
+    v[a] = REAL(args[a]);
+    len[a] = xlength(args[a]);
+    if (len[a] > n) n = len[a];
+  }
+  for (int a = 0; a < 6; a++) {
+    if (len[a] == 0) n = 0;
+  }
+
+  xts_civil_table_init();
+
+  SEXP _result = PROTECT(allocVector(REALSXP, n)); P++;
+  double *result = REAL(_result);
+  for (i = 0; i < n; i++) {
+    double y = v[0][i % len[0]], m = v[1][i % len[1]], d = v[2][i % len[2]],
+           H = v[3][i % len[3]], M = v[4][i % len[4]], S = v[5][i % len[5]];
+    /* ISOdatetime() pastes the fields together and parses them, so only
+     * whole numbers are valid, except for the seconds */
+    if (!R_FINITE(y) || !R_FINITE(m) || !R_FINITE(d) || !R_FINITE(H) ||
+        !R_FINITE(M) || !R_FINITE(S) || y != trunc(y) || m != trunc(m) ||
+        d != trunc(d) || H != trunc(H) || M != trunc(M) ||
+        y < CIVIL_MIN_YEAR || y > CIVIL_MAX_YEAR || m < 1 || m > 12 ||
+        d < 1 || d > xts_days_in_month((int64_t)y, (int)m) ||
+        H < 0 || H > 23 || M < 0 || M > 59 || S < 0 || S >= 62) {
+      result[i] = NA_REAL;
+      continue;
+    }
+    int64_t day = xts_days_from_civil((int64_t)y, (int)m, (int)d);
+    result[i] = (double)day * 86400.0 + H * 3600.0 + M * 60.0 + S;
+  }
+  UNPROTECT(P);
+  return _result;
+}
@@ -23,7 +23,167 @@
 #include <R.h>
 #include <Rinternals.h>
 #include <Rdefines.h>
+#include <Rversion.h>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "xts.h"
+
+/* minimum number of observations per thread in endpoints() */
+#define ENDPOINTS_MIN_CHUNK 262144
+
+/* Boundaries are found in chunks of the index, in parallel. The boundary
+ * test for observation i only depends on observations i and i-1, so each
+ * chunk is independent. A chunk [from, to) can not have more than to-from
+ * boundaries, so each one writes its boundaries to ep[from], ep[from+1], ...
+ * and the chunks are then moved next to each other. The keys (including
+ * the adjustments when the index starts before the epoch) are the same as
+ * in the serial loops in endpoints(). */
+#define ENDPOINTS_CHUNK(TYPE, KEY_TYPE, INDEX, ONE)                          \
+  do {                                                                       \
+    const TYPE *x = INDEX;                                                   \
+    if (negative) {                                                          \
+      TYPE v = x[from - 1];                                                  \
+      if (v < 0) v += ONE;                                                   \
+      KEY_TYPE prev = (KEY_TYPE)v / on / k;                                  \
+      for (R_xlen_t i = from; i < to; i++) {                                 \
+        v = x[i];                                                            \
+        int epoch_adj = (v == 0);                                            \
+        if (v < 0) v += ONE;                                                 \
+        KEY_TYPE key = (KEY_TYPE)v / on / k;                                 \
+        if (key + epoch_adj != prev) out[m++] = (int)i;                      \
+        prev = key;                                                          \
+      }                                                                      \
+    } else {                                                                 \
+      KEY_TYPE prev = (KEY_TYPE)x[from - 1] / on / k;                        \
+      for (R_xlen_t i = from; i < to; i++) {                                 \
+        KEY_TYPE key = (KEY_TYPE)x[i] / on / k;                              \
+        if (key != prev) out[m++] = (int)i;                                  \
+        prev = key;                                                          \
+      }                                                                      \
+    }                                                                        \
+  } while (0)
+
+static int
+endpoints_chunked(SEXP _x, int on, int k, int *ep, int nthreads)
+{
+  int nr = nrows(_x);
+  int nchunks = (nr - 1) / ENDPOINTS_MIN_CHUNK;
+  if (nchunks > nthreads) nchunks = nthreads;
+  if (nchunks < 1) nchunks = 1;
+
+  int type = TYPEOF(_x);
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+  int negative = int_index ? (int_index[0] < 0) : (real_index[0] < 0);
+
+  R_xlen_t *start = (R_xlen_t *) R_alloc(nchunks + 1, sizeof(R_xlen_t));
+  int *count = (int *) R_alloc(nchunks, sizeof(int));
+  for (int c = 0; c <= nchunks; c++) {
+    start[c] = 1 + (R_xlen_t)(nr - 1) * c / nchunks;
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nchunks) schedule(static, 1)
+#endif
+  for (int c = 0; c < nchunks; c++) {
+    R_xlen_t from = start[c], to = start[c + 1];
+    int *out = ep + from;
+    int m = 0;
+    if (int_index) {
+      ENDPOINTS_CHUNK(int, int, int_index, 1);
+    } else {
+      ENDPOINTS_CHUNK(double, int64_t, real_index, 1.0);
+    }
+    count[c] = m;
+  }
+
+  /* ep[j] is never after the start of chunk c, so move the chunks in order */
+  int j = 1;
+  for (int c = 0; c < nchunks; c++) {
+    if (count[c] > 0 && j != start[c])
+      memmove(ep + j, ep + start[c], count[c] * sizeof(int));
+    j += count[c];
+  }
+  return j;
+}
+
+/* Append 'value' to the growable endpoints vector */
+static int *
+ep_push(SEXP *_ep, PROTECT_INDEX ipx, int *ep, R_xlen_t *n, int value)
+{
+  R_xlen_t cap = XLENGTH(*_ep);
+  if (*n == cap) {
+    REPROTECT(*_ep = xlengthgets(*_ep, 2 * cap), ipx);
+    ep = INTEGER(*_ep);
+  }
+  ep[(*n)++] = value;
+  return ep;
+}
+
+/* endpoints() of a compact regular index with non-negative values. The
+ * first observation of each period is located arithmetically, so the cost
+ * is per period rather than per observation. */
+static SEXP
+regular_endpoints(const struct regular_index *r, int on, int k, int addlast)
+{
+  PROTECT_INDEX ipx;
+  SEXP _ep;
+  R_xlen_t n = 0, i = 0, nr = r->n;
+  PROTECT_WITH_INDEX(_ep = allocVector(INTSXP, 64), &ipx);
+  int *ep = ep_push(&_ep, ipx, INTEGER(_ep), &n, 0);
+
+  while (i < nr) {
+    /* same period as endpoints(): (int64_t)x / on / k */
+    int64_t key = (int64_t)xts_regular_value(r, i) / on / k;
+    i = xts_regular_lower(r, (double)((key + 1) * on * k));
+    if (i >= nr) break;
+    ep = ep_push(&_ep, ipx, ep, &n, (int)i);
+  }
+  if (ep[n - 1] != nr && addlast) {
+    ep = ep_push(&_ep, ipx, ep, &n, (int)nr);
+  }
+  REPROTECT(_ep = xlengthgets(_ep, n), ipx);
+  UNPROTECT(1);
+  return _ep;
+}
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+/* endpoints() of an ALTREP index whose values are not in memory, such as a
+ * packed index. The values are decoded one region at a time. Without ALTREP
+ * every index is in memory, so this is never needed. */
+#define XTS_HAVE_ENDPOINTS_REGIONS 1
+#define ENDPOINTS_REGION 1024
+
+static int
+endpoints_regions(SEXP _x, int on, int k, int *ep)
+{
+  R_xlen_t from, q, nr = xlength(_x);
+  double buf[ENDPOINTS_REGION];
+  int64_t key, prev = 0;
+  int j = 1;
+
+  REAL_GET_REGION(_x, 0, 1, buf);
+  int negative = buf[0] < 0;
+
+  for (from = 0; from < nr; from += ENDPOINTS_REGION) {
+    R_xlen_t len = REAL_GET_REGION(_x, from, ENDPOINTS_REGION, buf);
+    for (q = 0; q < len; q++) {
+      double v = buf[q];
+      /* same as the loops in endpoints(), including the epoch adjustment */
+      int epoch_adj = negative && (v == 0);
+      if (negative && v < 0) v += 1.0;
+      key = (int64_t)v / on / k + epoch_adj;
+      if (from + q > 0 && key != prev) ep[j++] = (int)(from + q);
+      prev = key - epoch_adj;
+    }
+  }
+  return j;
+}
+#endif
 
 SEXP endpoints (SEXP _x, SEXP _on, SEXP _k, SEXP _addlast /* TRUE */)
 {
@@ -33,7 +193,7 @@ SEXP endpoints (SEXP _x, SEXP _on, SEXP _k, SEXP _addlast /* TRUE */)
         c(0,which(diff(_x%/%on%/%k+1) != 0),NROW(_x))
   */
   int *int_index = NULL;
-  double *real_index = NULL;
+  const double *real_index = NULL;
   int i=1,j=1, nr, P=0;
   int int_tmp[2];
   int64_t int64_tmp[2];
@@ -47,10 +207,18 @@ SEXP endpoints (SEXP _x, SEXP _on, SEXP _k, SEXP _addlast /* TRUE */)
   /* ensure k > 0 (bug #4920) */
   if(k <= 0) error("'k' must be > 0");
 
+  struct regular_index regular;
+  if(xts_regular_index(_x, &regular) && on > 0 &&
+     xts_regular_value(&regular, 0) >= 0) {
+    return regular_endpoints(&regular, on, k, asLogical(_addlast));
+  }
+
   /* endpoints objects. max nr+2 ( c(0,ep,nr) ) */
   SEXP _ep = PROTECT(allocVector(INTSXP,nr+2)); P++;
   int *ep = INTEGER(_ep);
 
+  /* large indexes are searched in chunks, in parallel */
+  int nthreads = (nr > 2 * ENDPOINTS_MIN_CHUNK) ? xts_get_num_threads() : 1;
   
   /*switch(TYPEOF(getAttrib(_x, install("index")))) {*/
   switch(TYPEOF(_x)) {
@@ -59,8 +227,11 @@ SEXP endpoints (SEXP _x, SEXP _on, SEXP _k, SEXP _addlast /* TRUE */)
       /*int_index = INTEGER(getAttrib(_x, install("index")));*/
       int_index = INTEGER(_x);
       ep[0] = 0;
+      if(nthreads > 1) {
+          j = endpoints_chunked(_x, on, k, ep, nthreads);
+      }
       /* special handling if index values < 1970-01-01 00:00:00 UTC */
-      if(int_index[0] < 0) {
+      else if(int_index[0] < 0) {
           int_tmp[1] = (int_index[0] + 1) / on / k;
           for(i=1,j=1; i<nr; i++) {
             int idx_i0 = int_index[i];
@@ -92,10 +263,19 @@ SEXP endpoints (SEXP _x, SEXP _on, SEXP _k, SEXP _addlast /* TRUE */)
       break;
     case REALSXP:
       /*real_index = REAL(getAttrib(_x, install("index")));*/
-      real_index = REAL(_x);
       ep[0] = 0;
+#ifdef XTS_HAVE_ENDPOINTS_REGIONS
+      if(!xts_values_in_memory(_x)) {
+          j = endpoints_regions(_x, on, k, ep);
+          break;
+      }
+#endif
+      real_index = xts_real_values(_x);
+      if(nthreads > 1) {
+          j = endpoints_chunked(_x, on, k, ep, nthreads);
+      }
       /* special handling if index values < 1970-01-01 00:00:00 UTC */
-      if(real_index[0] < 0) {
+      else if(real_index[0] < 0) {
           int64_tmp[1] = (int64_t)(real_index[0] + 1) / on / k;
           for(i=1,j=1; i<nr; i++) {
             double idx_i0 = real_index[i];
@@ -138,3 +318,1936 @@ SEXP endpoints (SEXP _x, SEXP _on, SEXP _k, SEXP _addlast /* TRUE */)
   UNPROTECT(P);
   return(_ep);
 }
+
+/* Calendar endpoints
+ *
+ * Years, quarters, months and days are computed from the civil date of each
+ * index value in the series' time zone. Rather than building a POSIXlt
+ * object for the whole index (about 9x the memory of the index itself), the
+ * UTC offset is looked up in a table of transitions built once per time zone
+ * (see .tz_offsets() in R/endpoints.R) and the civil date is looked up in
+ * the civil calendar table (see calendar.c). The civil date is only recomputed when an observation
+ * falls outside the local period of the previous observation, so the cost
+ * per observation is a couple of comparisons.
+ */
+enum { CAL_YEARS, CAL_QUARTERS, CAL_MONTHS, CAL_DAYS };
+
+static int calendar_unit(const char *on)
+{
+  if (0 == strcmp(on, "years"))    return CAL_YEARS;
+  if (0 == strcmp(on, "quarters")) return CAL_QUARTERS;
+  if (0 == strcmp(on, "months"))   return CAL_MONTHS;
+  if (0 == strcmp(on, "days"))     return CAL_DAYS;
+  error("unsupported calendar period '%s'", on);
+  return -1; /* not reached */
+}
+
+/* floor division, like R's %/% */
+static int64_t floor_div(int64_t a, int64_t b)
+{
+  int64_t q = a / b;
+  return (q * b != a && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+struct calendar_period {
+  int64_t key;    /* period identifier, compared between observations */
+  double start;   /* first local second in the period */
+  double end;     /* first local second after the period */
+};
+
+static void
+calendar_period(double local, int on, int k, struct calendar_period *p)
+{
+  int64_t days = (int64_t)floor(local / 86400.0);
+  int64_t start, end;
+  struct civil_date date;
+
+  xts_civil_date(days, &date);
+  int64_t year = date.year;
+
+  switch (on) {
+    case CAL_YEARS:
+      /* (POSIXlt$year %/% k) */
+      p->key = floor_div(year - 1900, k);
+      start = days - date.yday;
+      end = xts_days_from_civil(year, 13, 1);
+      break;
+    case CAL_QUARTERS: {
+      int q = (date.mon - 1) / 3;
+      p->key = year * 4 + q;
+      start = xts_days_from_civil(year, 3 * q + 1, 1);
+      end = xts_days_from_civil(year, 3 * q + 4, 1);
+      break;
+    }
+    case CAL_MONTHS:
+      p->key = year * 12 + date.mon - 1;
+      start = days - date.mday + 1;
+      end = xts_days_from_civil(year, date.mon + 1, 1);
+      break;
+    default: /* CAL_DAYS */
+      /* (POSIXlt$year + 1900) * 1000 + POSIXlt$yday, truncated by k */
+      p->key = (year * 1000 + date.yday) / k;
+      start = days;
+      end = days + 1;
+      break;
+  }
+  p->start = 86400.0 * start;
+  p->end = 86400.0 * end;
+}
+
+/* UTC offset transitions: offset[j] applies from trans[j] (UTC seconds) up
+ * to trans[j+1], and trans[0] is -Inf. See .tz_offsets() in R/endpoints.R */
+struct tz_offsets {
+  const double *trans;
+  const double *offset;
+  R_xlen_t n;
+  R_xlen_t cur;   /* interval of the last lookup */
+};
+
+static void tz_offsets_init(SEXP _tzoffsets, struct tz_offsets *tz)
+{
+  SEXP _trans = VECTOR_ELT(_tzoffsets, 0);
+  SEXP _offset = VECTOR_ELT(_tzoffsets, 1);
+  if (TYPEOF(_trans) != REALSXP || TYPEOF(_offset) != REALSXP ||
+      xlength(_trans) < 1 || xlength(_trans) != xlength(_offset))
+    error("invalid time zone offset table");
+  tz->trans = REAL(_trans);
+  tz->offset = REAL(_offset);
+  tz->n = xlength(_trans);
+  tz->cur = 0;
+  /* every calendar kernel gets here before any parallel region */
+  xts_civil_table_init();
+}
+
+/* Local time of UTC time 't'. Sorted times usually stay in the interval of
+ * the last lookup or move to the next one; other times are found by binary
+ * search. Each thread uses its own copy of 'tz'. */
+static double tz_local(struct tz_offsets *tz, double t)
+{
+  R_xlen_t cur = tz->cur;
+  if (t >= tz->trans[cur] && (cur + 1 == tz->n || t < tz->trans[cur + 1]))
+    return t + tz->offset[cur];
+
+  if (cur + 2 < tz->n && t >= tz->trans[cur + 1] && t < tz->trans[cur + 2]) {
+    cur++;
+  } else {
+    /* last interval with trans[cur] <= t; trans[0] is -Inf */
+    R_xlen_t lo = 0, hi = tz->n;
+    while (hi - lo > 1) {
+      R_xlen_t mid = lo + (hi - lo) / 2;
+      if (t >= tz->trans[mid]) lo = mid; else hi = mid;
+    }
+    cur = lo;
+  }
+  tz->cur = cur;
+  return t + tz->offset[cur];
+}
+
+/* Add the last observation and thin the endpoints, as endpoints() does */
+static int *
+ep_finish(SEXP *_ep, PROTECT_INDEX ipx, int *ep, R_xlen_t *n, R_xlen_t nr,
+          int on, int k)
+{
+  /* years and quarters always end with NROW(x) */
+  if (on == CAL_YEARS || on == CAL_QUARTERS || ep[*n - 1] != nr) {
+    ep = ep_push(_ep, ipx, ep, n, (int)nr);
+  }
+
+  /* keep every k-th endpoint, and the last (include_last) */
+  if (k > 1 && (on == CAL_QUARTERS || on == CAL_MONTHS)) {
+    R_xlen_t m = 0;
+    for (R_xlen_t j = 0; j < *n; j += k) {
+      ep[m++] = ep[j];
+    }
+    if ((*n - 1) % k != 0) {
+      ep[m++] = ep[*n - 1];
+    }
+    *n = m;
+  }
+  return ep;
+}
+
+SEXP calendar_endpoints(SEXP _x, SEXP _on, SEXP _k, SEXP _tzoffsets)
+{
+  /*
+      Equivalent to the POSIXlt-based code previously in endpoints():
+
+        years:    c(0, which(diff(lt$year %/% k) != 0), NROW(x))
+        quarters: c(0, which(diff(year*4 + mon%/%3) != 0), NROW(x))
+        months:   c(0, which(diff(year*12 + mon) != 0), NROW(x)) [*]
+        days:     c(0, which(diff((year*1000 + yday) %/% k) != 0), NROW(x)) [*]
+
+      [*] NROW(x) only added if it is not already the last endpoint.
+      For quarters and months, every k-th endpoint is kept, along with the
+      last one. NA index values never start a new period.
+  */
+  int P = 0;
+  int on = calendar_unit(CHAR(STRING_ELT(_on, 0)));
+  int k = asInteger(_k);
+  if (k == NA_INTEGER || k <= 0) error("'k' must be > 0");
+
+  R_xlen_t nr = xlength(_x);
+  if (nr > INT_MAX) error("'x' has more than INT_MAX observations");
+
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  /* the common case has few endpoints relative to observations */
+  R_xlen_t cap = (nr < 1024) ? nr + 2 : 1024;
+  PROTECT_INDEX ipx;
+  SEXP _ep;
+  PROTECT_WITH_INDEX(_ep = allocVector(INTSXP, cap), &ipx); P++;
+  int *ep = INTEGER(_ep);
+  R_xlen_t n = 0;
+  ep[n++] = 0;
+
+  /* use period k for years and days; quarters and months are thinned below */
+  int key_k = (on == CAL_YEARS || on == CAL_DAYS) ? k : 1;
+
+  struct calendar_period period = { 0, R_PosInf, R_NegInf };
+  int have_prev = 0;
+
+  for (R_xlen_t i = 0; i < nr; i++) {
+    double t;
+    if (int_index) {
+      if (int_index[i] == NA_INTEGER) {
+        have_prev = 0;
+        continue;
+      }
+      t = (double)int_index[i];
+    } else {
+      t = real_index[i];
+      if (!R_FINITE(t)) {
+        have_prev = 0;
+        continue;
+      }
+    }
+
+    double local = tz_local(&tz, t);
+
+    if (local < period.start || local >= period.end) {
+      int64_t prev_key = period.key;
+      calendar_period(local, on, key_k, &period);
+      if (have_prev && period.key != prev_key) {
+        ep = ep_push(&_ep, ipx, ep, &n, (int)i);
+      }
+    }
+    have_prev = 1;
+  }
+
+  ep = ep_finish(&_ep, ipx, ep, &n, nr, on, k);
+
+  REPROTECT(_ep = xlengthgets(_ep, n), ipx);
+  UNPROTECT(P);
+  return _ep;
+}
+
+/* Multi-resolution endpoints
+ *
+ * endpoints() for several periods at once, in a single pass over the index.
+ * The periods are visited from finest to coarsest for each observation, and
+ * a coarser period is skipped when it is nested in the next finer one and
+ * the finer one did not change (e.g. there can be no day boundary between
+ * two observations in the same minute). Each result is identical to the
+ * corresponding endpoints() call.
+ */
+enum { EP_WEEKS = CAL_DAYS + 1, EP_HOURS, EP_MINUTES, EP_SECONDS, EP_MS, EP_US };
+
+enum { NEST_NONE, NEST_SAME, NEST_CALENDAR };
+
+struct ep_level {
+  int unit;
+  int k;
+  int key_k;        /* k used in the key; quarters and months are thinned */
+  int64_t on;       /* arithmetic units: 'on' argument to endpoints() */
+  int negative;     /* arithmetic units: first value is before the epoch */
+  int nested;       /* how all coarser levels are nested in this one */
+  double span;      /* approximate length of the period, in seconds */
+  int64_t key;      /* key of the previous observation */
+  double lo, hi;    /* arithmetic units: values with the same key */
+  int have_prev;    /* calendar units: previous observation was not NA */
+  struct calendar_period period;
+  SEXP ep;
+  PROTECT_INDEX ipx;
+  int *ptr;
+  R_xlen_t n;
+};
+
+static int period_unit(const char *on)
+{
+  if (0 == strcmp(on, "weeks"))   return EP_WEEKS;
+  if (0 == strcmp(on, "hours"))   return EP_HOURS;
+  if (0 == strcmp(on, "minutes")) return EP_MINUTES;
+  if (0 == strcmp(on, "seconds")) return EP_SECONDS;
+  if (0 == strcmp(on, "ms"))      return EP_MS;
+  if (0 == strcmp(on, "us"))      return EP_US;
+  return calendar_unit(on);
+}
+
+/* the value endpoints() passes to the C 'endpoints' routine */
+static double
+arith_value(int unit, int int_na, double t)
+{
+  switch (unit) {
+    case EP_WEEKS:
+      /* .index(x) + 3L*86400L */
+      if (int_na) return (double)INT_MIN;
+      return t + 3 * 86400;
+    case EP_MS:
+      return int_na ? NA_REAL : t * 1e3;
+    case EP_US:
+      return int_na ? NA_REAL : t * 1e6;
+    default:
+      return int_na ? (double)INT_MIN : t;
+  }
+}
+
+/* (int64_t)u, saturating like x86 for NaN and out-of-range values */
+static int64_t trunc_int64(double u)
+{
+  return (u > -9.2e18 && u < 9.2e18) ? (int64_t)u : INT64_MIN;
+}
+
+/* key used by the 'endpoints' routine, including the adjustments made when
+ * the index starts before the epoch */
+static int64_t
+arith_key(const struct ep_level *lev, double u, int *epoch_adj)
+{
+  *epoch_adj = 0;
+  if (lev->negative) {
+    *epoch_adj = (u == 0);
+    if (u < 0) u += 1.0;
+  }
+  return trunc_int64(u) / lev->on / lev->k;
+}
+
+static int
+level_nested(const struct ep_level *fine, const struct ep_level *coarse,
+             const struct tz_offsets *tz)
+{
+  int fu = fine->unit, cu = coarse->unit;
+
+  if (fu >= EP_WEEKS && cu >= EP_WEEKS) {
+    /* same transformation of the index, and a multiple of the period */
+    int same = (fu == cu) ||
+      ((fu == EP_HOURS || fu == EP_MINUTES || fu == EP_SECONDS) &&
+       (cu == EP_HOURS || cu == EP_MINUTES || cu == EP_SECONDS));
+    int64_t fd = fine->on * fine->k, cd = coarse->on * coarse->k;
+    return (same && cd % fd == 0) ? NEST_SAME : NEST_NONE;
+  }
+
+  if (fu >= EP_WEEKS) {
+    /* arithmetic periods that divide a day are nested in calendar periods
+     * if all UTC offsets and their transitions are aligned to the period */
+    if (cu > CAL_DAYS || fine->negative ||
+        !(fu == EP_HOURS || fu == EP_MINUTES || fu == EP_SECONDS))
+      return NEST_NONE;
+    int64_t fd = fine->on * fine->k;
+    if (86400 % fd != 0) return NEST_NONE;
+    for (R_xlen_t j = 0; j < tz->n; j++) {
+      if (fmod(tz->offset[j], (double)fd) != 0) return NEST_NONE;
+      if (j > 0 && fmod(tz->trans[j], (double)fd) != 0) return NEST_NONE;
+    }
+    return NEST_CALENDAR;
+  }
+
+  if (cu >= EP_WEEKS) return NEST_NONE;
+
+  /* calendar periods */
+  switch (fu) {
+    case CAL_DAYS:
+      if (cu == CAL_DAYS)
+        return (coarse->key_k % fine->key_k == 0) ? NEST_SAME : NEST_NONE;
+      return (fine->key_k == 1) ? NEST_SAME : NEST_NONE;
+    case CAL_MONTHS:
+      return (cu != CAL_DAYS) ? NEST_SAME : NEST_NONE;
+    case CAL_QUARTERS:
+      return (cu == CAL_QUARTERS || cu == CAL_YEARS) ? NEST_SAME : NEST_NONE;
+    default: /* CAL_YEARS */
+      return (cu == CAL_YEARS && coarse->k % fine->k == 0) ? NEST_SAME : NEST_NONE;
+  }
+}
+
+static void ep_level_init(struct ep_level *lev, const char *on, int k)
+{
+  lev->unit = period_unit(on);
+  lev->k = k;
+  if (k == NA_INTEGER || k <= 0) error("'k' must be > 0");
+
+  switch (lev->unit) {
+    case CAL_YEARS:    lev->span = 31556952.0 * k; break;
+    case CAL_QUARTERS: lev->span = 7889238.0;  break;
+    case CAL_MONTHS:   lev->span = 2629746.0;  break;
+    case CAL_DAYS:     lev->span = 86400.0 * k; break;
+    case EP_WEEKS:     lev->on = 604800; break;
+    case EP_HOURS:     lev->on = 3600; break;
+    case EP_MINUTES:   lev->on = 60; break;
+    default:           lev->on = 1; break;
+  }
+  if (lev->unit >= EP_WEEKS) {
+    lev->span = (double)lev->on * k;
+    if (lev->unit == EP_MS) lev->span /= 1e3;
+    if (lev->unit == EP_US) lev->span /= 1e6;
+  }
+  lev->key_k = (lev->unit == CAL_QUARTERS || lev->unit == CAL_MONTHS) ? 1 : k;
+  lev->negative = 0;
+  lev->nested = NEST_NONE;
+  lev->key = 0;
+  lev->lo = R_PosInf;
+  lev->hi = R_NegInf;
+  lev->have_prev = 0;
+  lev->period.key = 0;
+  lev->period.start = R_PosInf;
+  lev->period.end = R_NegInf;
+}
+
+/* Process the next observation 't' (NA if 'int_na') for one level, and
+ * return nonzero if it starts a new period. 'first' is set for the first
+ * observation of the series. '*unchanged' is set when the observation is
+ * known to be in the same period as the previous one, so coarser levels
+ * nested in this one can be skipped. The local time is only computed once
+ * per observation, by the first calendar level that needs it. */
+static int
+ep_level_step(struct ep_level *lev, int first, double t, int int_na,
+              struct tz_offsets *tz, double *local, int *have_local,
+              int *unchanged)
+{
+  int boundary = 0;
+
+  if (lev->unit >= EP_WEEKS) {
+    double u = arith_value(lev->unit, int_na, t);
+    if (first) {
+      lev->negative = u < 0;
+    }
+    if (u >= lev->lo && u < lev->hi) {
+      *unchanged = 1;
+    } else {
+      int adj;
+      int64_t key = arith_key(lev, u, &adj);
+      boundary = (!first && key + adj != lev->key);
+      *unchanged = (!first && key + adj == lev->key && !adj);
+      lev->key = key;
+      /* after the epoch, the key is constant in [key*d, (key+1)*d) */
+      if (key > 0 && u >= 0) {
+        double d = (double)(lev->on * lev->k);
+        lev->lo = key * d;
+        lev->hi = (key + 1) * d;
+      } else {
+        lev->lo = R_PosInf;
+        lev->hi = R_NegInf;
+      }
+    }
+
+    /* the calendar periods are only known to be the same if local time
+     * can not be rounded into the next period */
+    if (*unchanged && lev->nested == NEST_CALENDAR) {
+      *unchanged = (t >= lev->lo && t < lev->hi - 1);
+    }
+    return boundary;
+  }
+
+  if (int_na || !R_FINITE(t)) {
+    lev->have_prev = 0;
+    *unchanged = 0;
+    return 0;
+  }
+  if (!*have_local) {
+    *local = tz_local(tz, t);
+    *have_local = 1;
+  }
+  *unchanged = lev->have_prev;
+  if (*local < lev->period.start || *local >= lev->period.end) {
+    int64_t prev_key = lev->period.key;
+    calendar_period(*local, lev->unit, lev->key_k, &lev->period);
+    if (lev->have_prev && lev->period.key != prev_key) {
+      boundary = 1;
+      *unchanged = 0;
+    }
+  }
+  lev->have_prev = 1;
+  return boundary;
+}
+
+SEXP multi_endpoints(SEXP _x, SEXP _on, SEXP _k, SEXP _tzoffsets)
+{
+  int P = 0;
+  int nlev = length(_on);
+  if (TYPEOF(_on) != STRSXP || TYPEOF(_k) != INTSXP || length(_k) != nlev)
+    error("'on' and 'k' must be character and integer of the same length");
+
+  R_xlen_t nr = xlength(_x);
+  if (nr > INT_MAX) error("'x' has more than INT_MAX observations");
+
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  struct ep_level *levels =
+    (struct ep_level *) R_alloc(nlev, sizeof(struct ep_level));
+  int *order = (int *) R_alloc(nlev, sizeof(int));
+  R_xlen_t cap = (nr < 1024) ? nr + 2 : 1024;
+
+  for (int j = 0; j < nlev; j++) {
+    struct ep_level *lev = &levels[j];
+    ep_level_init(lev, CHAR(STRING_ELT(_on, j)), INTEGER(_k)[j]);
+    if (nr > 0 && lev->unit >= EP_WEEKS) {
+      /* needed to decide how the levels are nested */
+      int int_na = int_index && int_index[0] == NA_INTEGER;
+      double t = int_index ? (double)int_index[0] : real_index[0];
+      lev->negative = arith_value(lev->unit, int_na, t) < 0;
+    }
+    PROTECT_WITH_INDEX(lev->ep = allocVector(INTSXP, cap), &lev->ipx); P++;
+    lev->ptr = INTEGER(lev->ep);
+    lev->ptr[0] = 0;
+    lev->n = 1;
+
+    /* insertion sort from finest to coarsest, stable */
+    int m = j;
+    while (m > 0 && levels[order[m - 1]].span > lev->span) {
+      order[m] = order[m - 1];
+      m--;
+    }
+    order[m] = j;
+  }
+
+  /* all coarser levels can be skipped if every link in the chain is nested;
+   * one calendar link makes the whole chain conditional */
+  for (int j = nlev - 1; j >= 0; j--) {
+    struct ep_level *lev = &levels[order[j]];
+    if (j == nlev - 1) {
+      lev->nested = NEST_SAME;
+      continue;
+    }
+    int link = level_nested(lev, &levels[order[j + 1]], &tz);
+    int rest = levels[order[j + 1]].nested;
+    if (link == NEST_NONE || rest == NEST_NONE)
+      lev->nested = NEST_NONE;
+    else if (link == NEST_CALENDAR || rest == NEST_CALENDAR)
+      lev->nested = NEST_CALENDAR;
+    else
+      lev->nested = NEST_SAME;
+  }
+
+  for (R_xlen_t i = 0; i < nr; i++) {
+    int int_na = 0;
+    double t;
+    if (int_index) {
+      int_na = (int_index[i] == NA_INTEGER);
+      t = (double)int_index[i];
+    } else {
+      t = real_index[i];
+    }
+    int have_local = 0;
+    double local = 0;
+
+    for (int j = 0; j < nlev; j++) {
+      struct ep_level *lev = &levels[order[j]];
+      int unchanged;
+
+      if (ep_level_step(lev, i == 0, t, int_na, &tz, &local, &have_local,
+                        &unchanged)) {
+        lev->ptr = ep_push(&lev->ep, lev->ipx, lev->ptr, &lev->n, (int)i);
+      }
+      if (unchanged && lev->nested != NEST_NONE) break;
+    }
+  }
+
+  SEXP result = PROTECT(allocVector(VECSXP, nlev)); P++;
+  for (int j = 0; j < nlev; j++) {
+    struct ep_level *lev = &levels[j];
+    lev->ptr = ep_finish(&lev->ep, lev->ipx, lev->ptr, &lev->n, nr,
+                         lev->unit, lev->k);
+    SET_VECTOR_ELT(result, j, xlengthgets(lev->ep, lev->n));
+  }
+
+  UNPROTECT(P);
+  return result;
+}
+
+/* Incremental endpoints
+ *
+ * An endpoints tracker keeps the state of one period between calls, so the
+ * boundaries in observations appended to a series can be found without
+ * rescanning the series. The tracker is an external pointer, and its
+ * protected field holds the UTC offset table for calendar periods.
+ */
+struct ep_tracker {
+  struct ep_level level;
+  R_xlen_t nobs;          /* observations processed so far */
+  R_xlen_t nboundaries;   /* boundaries found so far, before thinning */
+  R_xlen_t tz_cur;        /* offset table cursor */
+};
+
+static SEXP ep_tracker_tag(void)
+{
+  return install("xts_endpoints_tracker");
+}
+
+static void ep_tracker_finalize(SEXP ptr)
+{
+  struct ep_tracker *tracker = (struct ep_tracker *) R_ExternalPtrAddr(ptr);
+  if (tracker) {
+    R_Free(tracker);
+    R_ClearExternalPtr(ptr);
+  }
+}
+
+static struct ep_tracker *ep_tracker_get(SEXP ptr)
+{
+  if (TYPEOF(ptr) != EXTPTRSXP || R_ExternalPtrTag(ptr) != ep_tracker_tag())
+    error("'tracker' must be an endpoints tracker");
+  struct ep_tracker *tracker = (struct ep_tracker *) R_ExternalPtrAddr(ptr);
+  /* e.g. after the tracker was saved and loaded */
+  if (!tracker) error("endpoints tracker is no longer valid");
+  return tracker;
+}
+
+SEXP endpoints_tracker(SEXP _on, SEXP _k, SEXP _tzoffsets)
+{
+  if (!isString(_on) || length(_on) != 1)
+    error("'on' must be a single period");
+
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  /* initialize (and validate) before allocating, so errors do not leak */
+  struct ep_level level;
+  ep_level_init(&level, CHAR(STRING_ELT(_on, 0)), asInteger(_k));
+
+  struct ep_tracker *tracker = R_Calloc(1, struct ep_tracker);
+  tracker->level = level;
+  tracker->nobs = 0;
+  tracker->nboundaries = 0;
+  tracker->tz_cur = 0;
+
+  SEXP ptr = PROTECT(R_MakeExternalPtr(tracker, ep_tracker_tag(), _tzoffsets));
+  R_RegisterCFinalizerEx(ptr, ep_tracker_finalize, TRUE);
+  UNPROTECT(1);
+  return ptr;
+}
+
+SEXP endpoints_tracker_update(SEXP _tracker, SEXP _x, SEXP _tzoffsets)
+{
+  /*
+      Returns the endpoints in the new observations '_x', as row numbers of
+      the whole series. The first observation of the series and the last
+      observation (NROW(x)) are never returned, since they are not known to
+      end a period until more observations arrive.
+  */
+  struct ep_tracker *tracker = ep_tracker_get(_tracker);
+  struct ep_level *lev = &tracker->level;
+
+  if (!isNull(_tzoffsets)) {
+    /* validate before replacing the table */
+    struct tz_offsets check;
+    tz_offsets_init(_tzoffsets, &check);
+    R_SetExternalPtrProtected(_tracker, _tzoffsets);
+  }
+  struct tz_offsets tz;
+  tz_offsets_init(R_ExternalPtrProtected(_tracker), &tz);
+  if (tracker->tz_cur < tz.n) tz.cur = tracker->tz_cur;
+
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+
+  R_xlen_t nr = xlength(_x);
+  if (nr > INT_MAX - tracker->nobs)
+    error("series has more than INT_MAX observations");
+
+  /* keep every k-th boundary for quarters and months (include_last) */
+  int thin = (lev->key_k != lev->k) ? lev->k : 1;
+
+  PROTECT_INDEX ipx;
+  SEXP _ep;
+  PROTECT_WITH_INDEX(_ep = allocVector(INTSXP, (nr < 1024) ? nr + 1 : 1024), &ipx);
+  int *ep = INTEGER(_ep);
+  R_xlen_t n = 0;
+
+  for (R_xlen_t i = 0; i < nr; i++) {
+    int int_na = 0;
+    double t;
+    if (int_index) {
+      int_na = (int_index[i] == NA_INTEGER);
+      t = (double)int_index[i];
+    } else {
+      t = real_index[i];
+    }
+    int have_local = 0, unchanged;
+    double local = 0;
+
+    if (ep_level_step(lev, tracker->nobs == 0, t, int_na, &tz, &local,
+                      &have_local, &unchanged)) {
+      tracker->nboundaries++;
+      if (tracker->nboundaries % thin == 0) {
+        ep = ep_push(&_ep, ipx, ep, &n, (int)tracker->nobs);
+      }
+    }
+    tracker->nobs++;
+  }
+  tracker->tz_cur = tz.cur;
+
+  REPROTECT(_ep = xlengthgets(_ep, n), ipx);
+  UNPROTECT(1);
+  return _ep;
+}
+
+/* Bar builder
+ *
+ * A bar builder aggregates a stream of observations into bars, like
+ * to.period() on the whole series, but only processes the new observations
+ * on each update. The periods are found by the same ep_level_step() as an
+ * endpoints tracker, and each output column keeps the running state of one
+ * aggregation function (see xts_agg_add() in toperiod.c) for the open bar.
+ * A bar is emitted when the first observation of the next period arrives.
+ */
+struct bar_builder {
+  struct ep_level level;
+  R_xlen_t nobs;          /* observations processed so far */
+  R_xlen_t nboundaries;   /* boundaries found so far, before thinning */
+  R_xlen_t tz_cur;        /* offset table cursor */
+  int ncol_x;             /* columns of the input, or -1 before the first */
+  int ncol;               /* output columns */
+  int *col;               /* input column of each output column, 0-based */
+  int *fun;               /* XTS_AGG_* of each output column */
+  int real_result;        /* double bars, otherwise integer */
+  int open;               /* a bar has observations */
+  double last_index;      /* index of the last observation in the open bar */
+  struct xts_agg_state *state;
+};
+
+static SEXP bar_builder_tag(void)
+{
+  return install("xts_bar_builder");
+}
+
+static void bar_builder_free(struct bar_builder *builder)
+{
+  R_Free(builder->col);
+  R_Free(builder->fun);
+  R_Free(builder->state);
+  R_Free(builder);
+}
+
+static void bar_builder_finalize(SEXP ptr)
+{
+  struct bar_builder *builder = (struct bar_builder *) R_ExternalPtrAddr(ptr);
+  if (builder) {
+    bar_builder_free(builder);
+    R_ClearExternalPtr(ptr);
+  }
+}
+
+static struct bar_builder *bar_builder_get(SEXP ptr)
+{
+  if (TYPEOF(ptr) != EXTPTRSXP || R_ExternalPtrTag(ptr) != bar_builder_tag())
+    error("'builder' must be a bar builder");
+  struct bar_builder *builder = (struct bar_builder *) R_ExternalPtrAddr(ptr);
+  if (!builder) error("bar builder is no longer valid");
+  return builder;
+}
+
+SEXP bar_builder(SEXP _on, SEXP _k, SEXP _tzoffsets, SEXP _columns,
+                 SEXP _funs)
+{
+  if (!isString(_on) || length(_on) != 1)
+    error("'on' must be a single period");
+  if (TYPEOF(_columns) != INTSXP || TYPEOF(_funs) != STRSXP ||
+      length(_columns) != length(_funs) || length(_columns) < 1)
+    error("invalid aggregation specification");
+
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  /* validate before allocating, so errors do not leak */
+  struct ep_level level;
+  ep_level_init(&level, CHAR(STRING_ELT(_on, 0)), asInteger(_k));
+  int ncol = length(_columns);
+  for (int c = 0; c < ncol; c++) {
+    xts_aggregate_fun(CHAR(STRING_ELT(_funs, c)));
+    if (INTEGER(_columns)[c] == NA_INTEGER || INTEGER(_columns)[c] < 1)
+      error("aggregation column %d is out of range", c + 1);
+  }
+
+  struct bar_builder *builder = R_Calloc(1, struct bar_builder);
+  builder->level = level;
+  builder->ncol_x = -1;
+  builder->ncol = ncol;
+  builder->col = R_Calloc(ncol, int);
+  builder->fun = R_Calloc(ncol, int);
+  builder->state = R_Calloc(ncol, struct xts_agg_state);
+  for (int c = 0; c < ncol; c++) {
+    builder->col[c] = INTEGER(_columns)[c] - 1;
+    builder->fun[c] = xts_aggregate_fun(CHAR(STRING_ELT(_funs, c)));
+  }
+
+  SEXP ptr = PROTECT(R_MakeExternalPtr(builder, bar_builder_tag(), _tzoffsets));
+  R_RegisterCFinalizerEx(ptr, bar_builder_finalize, TRUE);
+  UNPROTECT(1);
+  return ptr;
+}
+
+static void
+bar_emit(const struct bar_builder *builder, R_xlen_t row, R_xlen_t cap,
+         double *index, double *bars)
+{
+  index[row] = builder->last_index;
+  for (int c = 0; c < builder->ncol; c++) {
+    bars[row + c * cap] = xts_agg_value(&builder->state[c], builder->fun[c]);
+  }
+}
+
+SEXP bar_builder_update(SEXP _builder, SEXP _index, SEXP _x, SEXP _tzoffsets,
+                        SEXP _partial)
+{
+  /*
+      Returns list(index, data, partial) of the bars completed by the new
+      observations, with the index of the last observation in each bar.
+      When 'partial' is TRUE, the open bar is appended and the 'partial'
+      element is TRUE if there is one.
+  */
+  int P = 0;
+  struct bar_builder *builder = bar_builder_get(_builder);
+  struct ep_level *lev = &builder->level;
+
+  if (!isNull(_tzoffsets)) {
+    /* validate before replacing the table */
+    struct tz_offsets check;
+    tz_offsets_init(_tzoffsets, &check);
+    R_SetExternalPtrProtected(_builder, _tzoffsets);
+  }
+  struct tz_offsets tz;
+  tz_offsets_init(R_ExternalPtrProtected(_builder), &tz);
+  if (builder->tz_cur < tz.n) tz.cur = builder->tz_cur;
+
+  int type = TYPEOF(_index);
+  if (type != INTSXP && type != REALSXP) error("unsupported index type");
+  int *int_index = (type == INTSXP) ? INTEGER(_index) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_index) : NULL;
+
+  int mode = TYPEOF(_x);
+  if (mode != INTSXP && mode != REALSXP && mode != LGLSXP)
+    error("unsupported type");
+  R_xlen_t nr = xlength(_index);
+  if (nr >= INT_MAX) error("too many observations in one update");
+  int ncx = ncols(_x);
+  if (nrows(_x) != nr) error("'x' and 'index' must have the same length");
+
+  /* the first batch fixes the columns and the type of the bars */
+  if (builder->ncol_x < 0) {
+    for (int c = 0; c < builder->ncol; c++) {
+      if (builder->col[c] >= ncx)
+        error("aggregation column %d is out of range", c + 1);
+    }
+    builder->ncol_x = ncx;
+    builder->real_result = (mode == REALSXP);
+    for (int c = 0; c < builder->ncol; c++) {
+      if (builder->fun[c] == XTS_AGG_MEAN) builder->real_result = 1;
+    }
+  } else if (ncx != builder->ncol_x) {
+    error("'x' must have the same number of columns in every update");
+  }
+
+  const int *xi = (mode == REALSXP) ? NULL : INTEGER(_x);
+  const double *xr = (mode == REALSXP) ? REAL(_x) : NULL;
+  int ncol = builder->ncol;
+  int thin = (lev->key_k != lev->k) ? lev->k : 1;
+
+  /* at most one bar per observation, and the open bar */
+  R_xlen_t cap = nr + 1, nbars = 0;
+  double *index = (double *) R_alloc(cap, sizeof(double));
+  double *bars = (double *) R_alloc(cap * ncol, sizeof(double));
+
+  for (R_xlen_t i = 0; i < nr; i++) {
+    int int_na = 0;
+    double t;
+    if (int_index) {
+      int_na = (int_index[i] == NA_INTEGER);
+      t = (double)int_index[i];
+    } else {
+      t = real_index[i];
+    }
+    int have_local = 0, unchanged;
+    double local = 0;
+
+    if (ep_level_step(lev, builder->nobs == 0, t, int_na, &tz, &local,
+                      &have_local, &unchanged)) {
+      builder->nboundaries++;
+      if (builder->nboundaries % thin == 0 && builder->open) {
+        bar_emit(builder, nbars++, cap, index, bars);
+        builder->open = 0;
+      }
+    }
+
+    for (int c = 0; c < ncol; c++) {
+      R_xlen_t j = i + (R_xlen_t)builder->col[c] * nr;
+      double v = xr ? xr[j] : (xi[j] == NA_INTEGER ? NA_REAL : (double)xi[j]);
+      if (builder->open) {
+        xts_agg_add(&builder->state[c], v);
+      } else {
+        xts_agg_start(&builder->state[c], v);
+      }
+    }
+    builder->open = 1;
+    builder->last_index = int_na ? NA_REAL : t;
+    builder->nobs++;
+  }
+  builder->tz_cur = tz.cur;
+
+  int partial = asLogical(_partial) == TRUE && builder->open;
+  if (partial) {
+    bar_emit(builder, nbars++, cap, index, bars);
+  }
+
+  SEXP _result = PROTECT(allocVector(VECSXP, 3)); P++;
+  SEXP _bar_index = allocVector(type, nbars);
+  SET_VECTOR_ELT(_result, 0, _bar_index);
+  SEXP _bars = allocMatrix(builder->real_result ? REALSXP : INTSXP,
+                           (int)nbars, ncol);
+  SET_VECTOR_ELT(_result, 1, _bars);
+  SET_VECTOR_ELT(_result, 2, ScalarLogical(partial));
+
+  int overflow = 0;
+  for (R_xlen_t b = 0; b < nbars; b++) {
+    if (type == INTSXP) {
+      INTEGER(_bar_index)[b] = ISNAN(index[b]) ? NA_INTEGER : (int)index[b];
+    } else {
+      REAL(_bar_index)[b] = index[b];
+    }
+    for (int c = 0; c < ncol; c++) {
+      double v = bars[b + c * cap];
+      if (builder->real_result) {
+        REAL(_bars)[b + c * nbars] = v;
+      } else if (ISNAN(v)) {
+        INTEGER(_bars)[b + c * nbars] = NA_INTEGER;
+      } else if (fabs(v) > INT_MAX) {
+        INTEGER(_bars)[b + c * nbars] = NA_INTEGER;
+        overflow = 1;
+      } else {
+        INTEGER(_bars)[b + c * nbars] = (int)v;
+      }
+    }
+  }
+  if (overflow) warning("integer overflow - use sum(as.numeric(.))");
+
+  SEXP names = PROTECT(allocVector(STRSXP, 3)); P++;
+  SET_STRING_ELT(names, 0, mkChar("index"));
+  SET_STRING_ELT(names, 1, mkChar("data"));
+  SET_STRING_ELT(names, 2, mkChar("partial"));
+  setAttrib(_result, R_NamesSymbol, names);
+
+  UNPROTECT(P);
+  return _result;
+}
+
+/* to.period() of many series
+ *
+ * Each (series, period) pair is a task. The periods are found with the
+ * same ep_level_step() as an endpoints tracker, so the endpoints are
+ * identical to endpoints(). The tasks run in parallel twice: first to count
+ * the periods, so the results can be allocated on the main thread, and
+ * then to store the endpoints and aggregate them with
+ * xts_aggregate_periods(). Neither pass uses the R API or allocates memory.
+ */
+struct period_task {
+  const int *int_index;
+  const double *real_index;
+  const int *xi;
+  const double *xr;
+  R_xlen_t nr;
+  struct ep_level level;
+  struct tz_offsets tz;
+  int ncol;
+  const int *col;
+  const int *fun;
+  int nep;              /* endpoints, including 0 and nr */
+  int *ep;
+  int *index_int;       /* result index and data */
+  double *index_real;
+  int *result_int;
+  double *result_real;
+  int overflow;
+};
+
+/* Number of endpoints of one task, stored in 'ep' unless it is NULL. The
+ * level is reset first, so this can be called more than once. */
+static int period_task_endpoints(struct period_task *task, int *ep)
+{
+  struct ep_level lev = task->level;
+  struct tz_offsets tz = task->tz;
+  int thin = (lev.key_k != lev.k) ? lev.k : 1;
+  R_xlen_t nboundaries = 0;
+  int n = 0;
+
+  if (ep) ep[n] = 0;
+  n++;
+  for (R_xlen_t i = 0; i < task->nr; i++) {
+    int int_na = 0;
+    double t;
+    if (task->int_index) {
+      int_na = (task->int_index[i] == NA_INTEGER);
+      t = (double)task->int_index[i];
+    } else {
+      t = task->real_index[i];
+    }
+    int have_local = 0, unchanged;
+    double local = 0;
+
+    if (ep_level_step(&lev, i == 0, t, int_na, &tz, &local, &have_local,
+                      &unchanged) && ++nboundaries % thin == 0) {
+      if (ep) ep[n] = (int)i;
+      n++;
+    }
+  }
+  if (ep) ep[n] = (int)task->nr;
+  return n + 1;
+}
+
+SEXP to_period_list(SEXP _x, SEXP _on, SEXP _k, SEXP _tzoffsets,
+                    SEXP _specs)
+{
+  /*
+      Returns list(list(result for each period) for each series). '_x' is a
+      list of xts objects, '_on' and '_k' the periods, '_tzoffsets' a list
+      of the offset table of each series (used for calendar periods), and
+      '_specs' a list of list(columns, funs, names) for each series.
+  */
+  int P = 0;
+  if (TYPEOF(_x) != VECSXP || TYPEOF(_tzoffsets) != VECSXP ||
+      TYPEOF(_specs) != VECSXP || length(_tzoffsets) != length(_x) ||
+      length(_specs) != length(_x))
+    error("'x', 'tzoffsets' and 'specs' must be lists of the same length");
+  int nlev = length(_on);
+  if (TYPEOF(_on) != STRSXP || TYPEOF(_k) != INTSXP || length(_k) != nlev)
+    error("'on' and 'k' must be character and integer of the same length");
+
+  int nx = length(_x);
+  R_xlen_t ntask = (R_xlen_t)nx * nlev;
+  struct period_task *tasks =
+    (struct period_task *) R_alloc(ntask, sizeof(struct period_task));
+
+  /* validate and get the data pointers on the main thread */
+  for (int s = 0; s < nx; s++) {
+    SEXP x = VECTOR_ELT(_x, s);
+    SEXP spec = VECTOR_ELT(_specs, s);
+    SEXP index = getAttrib(x, xts_IndexSymbol);
+    int mode = TYPEOF(x), type = TYPEOF(index);
+    if (mode != INTSXP && mode != REALSXP && mode != LGLSXP)
+      error("unsupported type of series %d", s + 1);
+    if ((type != INTSXP && type != REALSXP) || xts_is_integer64(index))
+      error("unsupported index type of series %d", s + 1);
+    R_xlen_t nr = xlength(index);
+    if (nr >= INT_MAX) error("series %d has too many observations", s + 1);
+    if (nr == 0 || nrows(x) != nr) error("series %d contains no data", s + 1);
+
+    if (TYPEOF(spec) != VECSXP || length(spec) != 3)
+      error("invalid aggregation specification");
+    SEXP columns = VECTOR_ELT(spec, 0), funs = VECTOR_ELT(spec, 1);
+    if (TYPEOF(columns) != INTSXP || TYPEOF(funs) != STRSXP ||
+        length(columns) != length(funs))
+      error("invalid aggregation specification");
+    int ncol = length(columns);
+    int *fun = (int *) R_alloc(ncol, sizeof(int));
+    for (int c = 0; c < ncol; c++) {
+      fun[c] = xts_aggregate_fun(CHAR(STRING_ELT(funs, c)));
+      int col = INTEGER(columns)[c];
+      if (col == NA_INTEGER || col < 1 || col > ncols(x))
+        error("aggregation column %d is out of range", c + 1);
+    }
+
+    struct tz_offsets tz;
+    tz_offsets_init(VECTOR_ELT(_tzoffsets, s), &tz);
+    const int *int_index = (type == INTSXP) ? INTEGER(index) : NULL;
+    const double *real_index = (type == REALSXP) ? xts_real_values(index) : NULL;
+
+    for (int j = 0; j < nlev; j++) {
+      struct period_task *task = &tasks[(R_xlen_t)s * nlev + j];
+      memset(task, 0, sizeof(struct period_task));
+      task->int_index = int_index;
+      task->real_index = real_index;
+      task->xi = (mode == REALSXP) ? NULL : INTEGER(x);
+      task->xr = (mode == REALSXP) ? REAL(x) : NULL;
+      task->nr = nr;
+      ep_level_init(&task->level, CHAR(STRING_ELT(_on, j)), INTEGER(_k)[j]);
+      task->tz = tz;
+      task->ncol = ncol;
+      task->col = INTEGER(columns);
+      task->fun = fun;
+    }
+  }
+
+  int nthreads = xts_get_num_threads();
+  if (nthreads > ntask) nthreads = (ntask > 0) ? (int)ntask : 1;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+#endif
+  for (R_xlen_t t = 0; t < ntask; t++) {
+    tasks[t].nep = period_task_endpoints(&tasks[t], NULL);
+  }
+
+  /* allocate the results, as period_aggregate() returns them */
+  SEXP result = PROTECT(allocVector(VECSXP, nx)); P++;
+  for (int s = 0; s < nx; s++) {
+    SEXP x = VECTOR_ELT(_x, s);
+    SEXP index = getAttrib(x, xts_IndexSymbol);
+    SEXP colnames = VECTOR_ELT(VECTOR_ELT(_specs, s), 2);
+    SEXP bars = allocVector(VECSXP, nlev);
+    SET_VECTOR_ELT(result, s, bars);
+
+    int real_result = (TYPEOF(x) == REALSXP);
+    struct period_task *first = &tasks[(R_xlen_t)s * nlev];
+    for (int c = 0; c < first->ncol; c++) {
+      if (first->fun[c] == XTS_AGG_MEAN) real_result = 1;
+    }
+
+    for (int j = 0; j < nlev; j++) {
+      struct period_task *task = &tasks[(R_xlen_t)s * nlev + j];
+      int n = task->nep - 1;
+      SEXP y = allocMatrix(real_result ? REALSXP : INTSXP, n, task->ncol);
+      SET_VECTOR_ELT(bars, j, y);
+      SEXP newindex = PROTECT(allocVector(TYPEOF(index), n));
+      copyMostAttrib(index, newindex);
+      setAttrib(y, xts_IndexSymbol, newindex);
+      UNPROTECT(1);
+      SEXP dimnames = PROTECT(allocVector(VECSXP, 2));
+      SET_VECTOR_ELT(dimnames, 1, colnames);
+      setAttrib(y, R_DimNamesSymbol, dimnames);
+      UNPROTECT(1);
+      copy_xtsAttributes(x, y);
+      copy_xtsCoreAttributes(x, y);
+
+      task->ep = (int *) R_alloc(task->nep, sizeof(int));
+      if (real_result) task->result_real = REAL(y);
+      else task->result_int = INTEGER(y);
+      if (TYPEOF(index) == INTSXP) task->index_int = INTEGER(newindex);
+      else task->index_real = REAL(newindex);
+    }
+  }
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic, 1)
+#endif
+  for (R_xlen_t t = 0; t < ntask; t++) {
+    struct period_task *task = &tasks[t];
+    period_task_endpoints(task, task->ep);
+    int n = task->nep - 1;
+    /* index of the last observation of each period */
+    for (int i = 0; i < n; i++) {
+      if (task->index_int) {
+        task->index_int[i] = task->int_index[task->ep[i + 1] - 1];
+      } else {
+        task->index_real[i] = task->real_index[task->ep[i + 1] - 1];
+      }
+    }
+    task->overflow =
+      xts_aggregate_periods(task->xi, task->xr, task->nr, task->ep, n,
+                            task->ncol, task->col, task->fun,
+                            task->result_int, task->result_real);
+  }
+
+  int overflow = 0;
+  for (R_xlen_t t = 0; t < ntask; t++) {
+    overflow |= tasks[t].overflow;
+  }
+  if (overflow) warning("integer overflow - use sum(as.numeric(.))");
+
+  UNPROTECT(P);
+  return result;
+}
+
+/* Trading session endpoints
+ *
+ * A trading session (see tradingSession() in R/endpoints.R) has a session
+ * day that starts 'day_start' seconds after local midnight, one or more
+ * [open, close) windows, as seconds from the start of the session day, and
+ * a sorted vector of holidays, as the day number of the session label.
+ * Each window on each session day is a period. Observations outside the
+ * windows, or on holidays, are grouped into periods between the windows,
+ * which are flagged as not in session.
+ */
+struct session_slot {
+  int64_t key;
+  int in_session;
+  double start;   /* first local second in the slot */
+  double end;     /* first local second after the slot */
+};
+
+static void
+session_slot(double local, double day_start, const double *open,
+             const double *close, int nwin, const double *holidays,
+             R_xlen_t nholidays, int label_shift, struct session_slot *slot)
+{
+  int64_t day = (int64_t)floor((local - day_start) / 86400.0);
+  double day_origin = (double)day * 86400.0 + day_start;
+  double s = local - day_origin;
+
+  /* holidays are out of session for the whole session day */
+  double label = (double)(day + label_shift);
+  R_xlen_t lo = 0, hi = nholidays;
+  while (lo < hi) {
+    R_xlen_t mid = lo + (hi - lo) / 2;
+    if (holidays[mid] < label) lo = mid + 1; else hi = mid;
+  }
+  if (lo < nholidays && holidays[lo] == label) {
+    slot->key = day * (2 * nwin + 1);
+    slot->in_session = 0;
+    slot->start = day_origin;
+    slot->end = day_origin + 86400.0;
+    return;
+  }
+
+  /* slot is the number of window edges at or before s: odd slots are in a
+   * window, even slots are before, between, or after the windows */
+  int edge = 0;
+  double prev = 0, next = 86400.0;
+  for (int w = 0; w < nwin; w++) {
+    if (s >= open[w]) { edge++; prev = open[w]; } else { next = open[w]; break; }
+    if (s >= close[w]) { edge++; prev = close[w]; } else { next = close[w]; break; }
+  }
+  slot->key = day * (2 * nwin + 1) + edge;
+  slot->in_session = edge % 2;
+  slot->start = day_origin + prev;
+  slot->end = day_origin + next;
+}
+
+SEXP session_endpoints(SEXP _x, SEXP _day_start, SEXP _open, SEXP _close,
+                       SEXP _holidays, SEXP _tzoffsets)
+{
+  int P = 0;
+  R_xlen_t nr = xlength(_x);
+  if (nr > INT_MAX) error("'x' has more than INT_MAX observations");
+
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+
+  if (TYPEOF(_open) != REALSXP || TYPEOF(_close) != REALSXP ||
+      TYPEOF(_holidays) != REALSXP || length(_open) != length(_close) ||
+      length(_open) < 1)
+    error("invalid trading session");
+  double day_start = asReal(_day_start);
+  const double *open = REAL(_open);
+  const double *close = REAL(_close);
+  int nwin = length(_open);
+  const double *holidays = REAL(_holidays);
+  R_xlen_t nholidays = xlength(_holidays);
+  /* sessions starting in the afternoon are labelled with the next date */
+  int label_shift = (day_start >= 43200) ? 1 : 0;
+
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  R_xlen_t cap = (nr < 1024) ? nr + 2 : 1024;
+  PROTECT_INDEX ipx, ipx_in;
+  SEXP _ep, _in;
+  PROTECT_WITH_INDEX(_ep = allocVector(INTSXP, cap), &ipx); P++;
+  PROTECT_WITH_INDEX(_in = allocVector(INTSXP, cap), &ipx_in); P++;
+  int *ep = INTEGER(_ep);
+  int *in = INTEGER(_in);
+  R_xlen_t n = 0, nin = 0;
+  ep[n++] = 0;
+
+  struct session_slot slot = { 0, 0, R_PosInf, R_NegInf };
+  int have_prev = 0;
+
+  for (R_xlen_t i = 0; i < nr; i++) {
+    double t;
+    if (int_index) {
+      if (int_index[i] == NA_INTEGER) {
+        have_prev = 0;
+        continue;
+      }
+      t = (double)int_index[i];
+    } else {
+      t = real_index[i];
+      if (!R_FINITE(t)) {
+        have_prev = 0;
+        continue;
+      }
+    }
+
+    double local = tz_local(&tz, t);
+    if (local < slot.start || local >= slot.end) {
+      int64_t prev_key = slot.key;
+      int prev_in = slot.in_session;
+      session_slot(local, day_start, open, close, nwin, holidays, nholidays,
+                   label_shift, &slot);
+      if (have_prev && slot.key != prev_key) {
+        ep = ep_push(&_ep, ipx, ep, &n, (int)i);
+        in = ep_push(&_in, ipx_in, in, &nin, prev_in);
+      }
+    }
+    have_prev = 1;
+  }
+
+  if (ep[n - 1] != nr) {
+    ep = ep_push(&_ep, ipx, ep, &n, (int)nr);
+    in = ep_push(&_in, ipx_in, in, &nin, slot.in_session);
+  }
+
+  REPROTECT(_ep = xlengthgets(_ep, n), ipx);
+  SEXP _in_session = PROTECT(allocVector(LGLSXP, nin)); P++;
+  for (R_xlen_t j = 0; j < nin; j++) {
+    LOGICAL(_in_session)[j] = in[j];
+  }
+  setAttrib(_ep, install("in.session"), _in_session);
+
+  UNPROTECT(P);
+  return _ep;
+}
+
+/* about +/- 3 million years, so years and days fit in an int */
+#define INDEX_FIELD_MAX_SECONDS 1e14
+
+/* Business days
+ *
+ * A business calendar (see businessCalendar() in R/calendar.R) has a mask
+ * of the business days of the week, as bits 0 (Sunday) to 6 (Saturday) like
+ * POSIXlt$wday, and a sorted vector of holidays, as days since 1970-01-01.
+ * Only holidays that fall on business weekdays matter, so counts between
+ * two days are whole weeks, a partial week, and two binary searches in the
+ * holidays.
+ */
+struct business_calendar {
+  int weekmask;
+  int nweek;                /* business days per week */
+  int week_before[8];       /* business weekdays before weekday w */
+  double *holidays;         /* on business weekdays */
+  R_xlen_t nholidays;
+};
+
+/* 1970-01-01 was a Thursday */
+static int day_wday(int64_t day)
+{
+  return (int)((day % 7 + 11) % 7);
+}
+
+static void
+business_calendar_init(SEXP _weekmask, SEXP _holidays,
+                       struct business_calendar *cal)
+{
+  if (TYPEOF(_holidays) != REALSXP) error("invalid business calendar");
+  cal->weekmask = asInteger(_weekmask);
+  if (cal->weekmask == NA_INTEGER || cal->weekmask < 1 || cal->weekmask > 127)
+    error("a business calendar needs at least one business day per week");
+
+  cal->nweek = 0;
+  for (int w = 0; w < 7; w++) {
+    cal->week_before[w] = cal->nweek;
+    cal->nweek += (cal->weekmask >> w) & 1;
+  }
+  cal->week_before[7] = cal->nweek;
+
+  R_xlen_t i, n = xlength(_holidays);
+  const double *holidays = REAL(_holidays);
+  cal->holidays = (double *) R_alloc(n + 1, sizeof(double));
+  cal->nholidays = 0;
+  for (i = 0; i < n; i++) {
+    double h = holidays[i];
+    if (!R_FINITE(h)) continue;
+    if (i > 0 && !(h > holidays[i - 1]))
+      error("business calendar holidays must be sorted and unique");
+    if ((cal->weekmask >> day_wday((int64_t)h)) & 1)
+      cal->holidays[cal->nholidays++] = h;
+  }
+}
+
+/* number of holidays before 'day' */
+static R_xlen_t business_holiday_rank(const struct business_calendar *cal,
+                                      int64_t day)
+{
+  double d = (double)day;
+  R_xlen_t lo = 0, hi = cal->nholidays;
+  while (lo < hi) {
+    R_xlen_t mid = lo + (hi - lo) / 2;
+    if (cal->holidays[mid] < d) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+static int business_day(const struct business_calendar *cal, int64_t day)
+{
+  if (!((cal->weekmask >> day_wday(day)) & 1)) return 0;
+  R_xlen_t r = business_holiday_rank(cal, day);
+  return !(r < cal->nholidays && cal->holidays[r] == (double)day);
+}
+
+/* business days in [a, b), or minus the business days in [b, a) */
+static int64_t
+business_count(const struct business_calendar *cal, int64_t a, int64_t b)
+{
+  if (b < a) return -business_count(cal, b, a);
+  int64_t weeks = (b - a) / 7;
+  int wa = day_wday(a), rem = (int)((b - a) % 7);
+  /* the partial week is weekdays wa, ..., wa + rem - 1 (mod 7) */
+  int64_t count = weeks * cal->nweek;
+  if (wa + rem <= 7) {
+    count += cal->week_before[wa + rem] - cal->week_before[wa];
+  } else {
+    count += cal->nweek - cal->week_before[wa] +
+             cal->week_before[wa + rem - 7];
+  }
+  return count - (business_holiday_rank(cal, b) -
+                  business_holiday_rank(cal, a));
+}
+
+enum { ROLL_FOLLOWING, ROLL_PRECEDING, ROLL_MODFOLLOWING, ROLL_MODPRECEDING };
+
+static int business_roll_type(const char *roll)
+{
+  if (0 == strcmp(roll, "following"))         return ROLL_FOLLOWING;
+  if (0 == strcmp(roll, "preceding"))         return ROLL_PRECEDING;
+  if (0 == strcmp(roll, "modifiedfollowing")) return ROLL_MODFOLLOWING;
+  if (0 == strcmp(roll, "modifiedpreceding")) return ROLL_MODPRECEDING;
+  error("unsupported roll convention '%s'", roll);
+  return -1; /* not reached */
+}
+
+/* the business day on or after (or before) 'day'. The modified conventions
+ * go the other way when the first one would change the month. */
+static int64_t
+business_roll(const struct business_calendar *cal, int64_t day, int roll)
+{
+  int64_t next = day, prev = day;
+  if (roll != ROLL_PRECEDING) {
+    while (!business_day(cal, next)) next++;
+    if (roll == ROLL_FOLLOWING || next == day) return next;
+  }
+  while (!business_day(cal, prev)) prev--;
+  if (roll == ROLL_PRECEDING || prev == day) return prev;
+
+  struct civil_date date, rolled;
+  xts_civil_date(day, &date);
+  if (roll == ROLL_MODFOLLOWING) {
+    xts_civil_date(next, &rolled);
+    return (rolled.mon == date.mon) ? next : prev;
+  }
+  xts_civil_date(prev, &rolled);
+  return (rolled.mon == date.mon) ? prev : next;
+}
+
+/* the business day 'n' business days after the business day 'day' */
+static int64_t
+business_offset(const struct business_calendar *cal, int64_t day, int64_t n)
+{
+  if (n == 0) return day;
+  /* whole weeks are a lower bound on the distance; holidays add to it */
+  int64_t step = (n > 0 ? n : -n) / cal->nweek * 7;
+  int64_t lo, hi;
+  if (n > 0) {
+    /* smallest e with n + 1 business days in [day, e] */
+    lo = day + step;
+    hi = lo + 7;
+    while (business_count(cal, day, hi + 1) < n + 1) hi += hi - day + 7;
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (business_count(cal, day, mid + 1) >= n + 1) hi = mid; else lo = mid + 1;
+    }
+    return lo;
+  }
+  /* largest e with -n business days in [e, day) */
+  hi = day - step;
+  lo = hi - 7;
+  while (business_count(cal, lo, day) < -n) lo -= day - lo + 7;
+  while (lo < hi) {
+    int64_t mid = hi - (hi - lo) / 2;
+    if (business_count(cal, mid, day) >= -n) lo = mid; else hi = mid - 1;
+  }
+  return lo;
+}
+
+/* days since 1970-01-01, or NA */
+static int days_value(SEXP _x, R_xlen_t i, int64_t *day)
+{
+  if (TYPEOF(_x) == INTSXP) {
+    int v = INTEGER(_x)[i];
+    if (v == NA_INTEGER) return 0;
+    *day = v;
+    return 1;
+  }
+  double v = REAL(_x)[i];
+  if (!R_FINITE(v) || fabs(v) > INDEX_FIELD_MAX_SECONDS / 86400.0) return 0;
+  *day = (int64_t)floor(v);
+  return 1;
+}
+
+/* TRUE for the observations on business days, in one pass over the index.
+ * The calendar is only checked when the local day changes. */
+SEXP business_day_mask(SEXP _x, SEXP _weekmask, SEXP _holidays,
+                       SEXP _tzoffsets)
+{
+  R_xlen_t i, nr = xlength(_x);
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+
+  struct business_calendar cal;
+  business_calendar_init(_weekmask, _holidays, &cal);
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  SEXP _result = PROTECT(allocVector(LGLSXP, nr));
+  int *result = LOGICAL(_result);
+  int64_t cur_day = INT64_MIN;
+  int cur = NA_LOGICAL;
+
+  for (i = 0; i < nr; i++) {
+    double t = (int_index) ?
+      ((int_index[i] == NA_INTEGER) ? NA_REAL : (double)int_index[i]) :
+      real_index[i];
+    if (!R_FINITE(t) || fabs(t) > INDEX_FIELD_MAX_SECONDS) {
+      result[i] = NA_LOGICAL;
+      continue;
+    }
+    int64_t day = (int64_t)floor(tz_local(&tz, t) / 86400.0);
+    if (day != cur_day) {
+      cur = business_day(&cal, day);
+      cur_day = day;
+    }
+    result[i] = cur;
+  }
+
+  UNPROTECT(1);
+  return _result;
+}
+
+/* business days in [from, to), for days since 1970-01-01 */
+SEXP business_day_count(SEXP _from, SEXP _to, SEXP _weekmask,
+                        SEXP _holidays)
+{
+  struct business_calendar cal;
+  business_calendar_init(_weekmask, _holidays, &cal);
+
+  R_xlen_t nf = xlength(_from), nt = xlength(_to);
+  R_xlen_t i, n = (nf == 0 || nt == 0) ? 0 : (nf > nt ? nf : nt);
+  SEXP _result = PROTECT(allocVector(REALSXP, n));
+  double *result = REAL(_result);
+  for (i = 0; i < n; i++) {
+    int64_t a, b;
+    if (!days_value(_from, i % nf, &a) || !days_value(_to, i % nt, &b)) {
+      result[i] = NA_REAL;
+      continue;
+    }
+    result[i] = (double)business_count(&cal, a, b);
+  }
+  UNPROTECT(1);
+  return _result;
+}
+
+/* 'dates' rolled to a business day, and moved 'n' business days */
+SEXP business_day_offset(SEXP _dates, SEXP _n, SEXP _roll, SEXP _weekmask,
+                         SEXP _holidays)
+{
+  struct business_calendar cal;
+  business_calendar_init(_weekmask, _holidays, &cal);
+  int roll = business_roll_type(CHAR(STRING_ELT(_roll, 0)));
+  xts_civil_table_init();
+
+  R_xlen_t nd = xlength(_dates), nn = xlength(_n);
+  R_xlen_t i, n = (nd == 0 || nn == 0) ? 0 : (nd > nn ? nd : nn);
+  SEXP _result = PROTECT(allocVector(REALSXP, n));
+  double *result = REAL(_result);
+  for (i = 0; i < n; i++) {
+    int64_t day, k;
+    if (!days_value(_dates, i % nd, &day) || !days_value(_n, i % nn, &k)) {
+      result[i] = NA_REAL;
+      continue;
+    }
+    day = business_roll(&cal, day, roll);
+    result[i] = (double)business_offset(&cal, day, k);
+  }
+  UNPROTECT(1);
+  return _result;
+}
+
+/* Endpoints of every 'k' business days. Observations on other days belong
+ * to the next business day, so e.g. weekend ticks are part of Monday. */
+SEXP business_endpoints(SEXP _x, SEXP _k, SEXP _weekmask, SEXP _holidays,
+                        SEXP _tzoffsets)
+{
+  R_xlen_t i, nr = xlength(_x);
+  if (nr > INT_MAX) error("'x' has more than INT_MAX observations");
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+  int k = asInteger(_k);
+  if (k == NA_INTEGER || k < 1) error("'k' must be a positive integer");
+
+  struct business_calendar cal;
+  business_calendar_init(_weekmask, _holidays, &cal);
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  R_xlen_t cap = (nr < 1024) ? nr + 2 : 1024;
+  PROTECT_INDEX ipx;
+  SEXP _ep;
+  PROTECT_WITH_INDEX(_ep = allocVector(INTSXP, cap), &ipx);
+  int *ep = INTEGER(_ep);
+  R_xlen_t n = 0;
+  ep[n++] = 0;
+
+  int64_t cur_day = INT64_MIN, key = 0, prev_key = 0;
+  int have_prev = 0;
+  for (i = 0; i < nr; i++) {
+    double t = (int_index) ?
+      ((int_index[i] == NA_INTEGER) ? NA_REAL : (double)int_index[i]) :
+      real_index[i];
+    if (!R_FINITE(t) || fabs(t) > INDEX_FIELD_MAX_SECONDS) {
+      have_prev = 0;
+      continue;
+    }
+    int64_t day = (int64_t)floor(tz_local(&tz, t) / 86400.0);
+    if (day != cur_day) {
+      /* business days since 1970-01-01 of the business day it rolls to */
+      int64_t bday = business_roll(&cal, day, ROLL_FOLLOWING);
+      key = floor_div(business_count(&cal, 0, bday), k);
+      cur_day = day;
+    }
+    if (have_prev && key != prev_key) {
+      ep = ep_push(&_ep, ipx, ep, &n, (int)i);
+    }
+    prev_key = key;
+    have_prev = 1;
+  }
+  if (ep[n - 1] != nr) {
+    ep = ep_push(&_ep, ipx, ep, &n, (int)nr);
+  }
+
+  REPROTECT(_ep = xlengthgets(_ep, n), ipx);
+  UNPROTECT(1);
+  return _ep;
+}
+
+/*
+ * Activity bars
+ *
+ * Bars that close when the activity since the previous bar reaches a
+ * threshold, instead of at time boundaries: every 'threshold' observations
+ * (ticks), units of volume, or dollars (price * volume) traded. The
+ * observation that reaches the threshold closes the bar, and the excess is
+ * carried over to the next bar, so the number of bars only depends on the
+ * total activity.
+ *
+ * Imbalance bars accumulate the activity signed by the tick rule (the sign
+ * of the last price change, which carries over across bars), and close
+ * when the absolute imbalance reaches the threshold. Each bar starts with
+ * no imbalance. Missing prices and volumes are no activity.
+ */
+enum { ACT_TICKS, ACT_VOLUME, ACT_DOLLARS, ACT_TICK_IMBALANCE,
+       ACT_VOLUME_IMBALANCE, ACT_DOLLAR_IMBALANCE };
+
+static int activity_type(const char *type)
+{
+  if (0 == strcmp(type, "ticks"))            return ACT_TICKS;
+  if (0 == strcmp(type, "volume"))           return ACT_VOLUME;
+  if (0 == strcmp(type, "dollars"))          return ACT_DOLLARS;
+  if (0 == strcmp(type, "tick.imbalance"))   return ACT_TICK_IMBALANCE;
+  if (0 == strcmp(type, "volume.imbalance")) return ACT_VOLUME_IMBALANCE;
+  if (0 == strcmp(type, "dollar.imbalance")) return ACT_DOLLAR_IMBALANCE;
+  error("unsupported activity bar type '%s'", type);
+  return -1; /* not reached */
+}
+
+/* column 'col' (0-based, or -1 for none) of row i, with NA as NA_REAL */
+static inline double
+activity_value(const int *xi, const double *xr, R_xlen_t nr, int col,
+               R_xlen_t i)
+{
+  if (col < 0) return NA_REAL;
+  R_xlen_t j = i + (R_xlen_t)col * nr;
+  if (xr) return xr[j];
+  return (xi[j] == NA_INTEGER) ? NA_REAL : (double)xi[j];
+}
+
+SEXP activity_endpoints(SEXP _x, SEXP _price, SEXP _volume, SEXP _type,
+                        SEXP _threshold)
+{
+  /*
+      Returns the endpoints of the activity bars of the matrix '_x', in the
+      format of endpoints(). '_price' and '_volume' are 1-based columns of
+      '_x', or NA when they are not needed.
+  */
+  int mode = TYPEOF(_x);
+  if (mode != INTSXP && mode != REALSXP && mode != LGLSXP)
+    error("unsupported type");
+  R_xlen_t nr = nrows(_x);
+  if (nr > INT_MAX) error("'x' has more than INT_MAX observations");
+  int ncx = ncols(_x);
+
+  int type = activity_type(CHAR(STRING_ELT(_type, 0)));
+  double threshold = asReal(_threshold);
+  if (!R_FINITE(threshold) || threshold <= 0)
+    error("'threshold' must be a positive number");
+
+  int price = asInteger(_price), volume = asInteger(_volume);
+  price = (price == NA_INTEGER) ? -1 : price - 1;
+  volume = (volume == NA_INTEGER) ? -1 : volume - 1;
+  if (price >= ncx || volume >= ncx)
+    error("price or volume column is out of range");
+  int need_price = (type == ACT_DOLLARS || type >= ACT_TICK_IMBALANCE);
+  int need_volume = (type == ACT_VOLUME || type == ACT_DOLLARS ||
+                     type == ACT_VOLUME_IMBALANCE ||
+                     type == ACT_DOLLAR_IMBALANCE);
+  if ((need_price && price < 0) || (need_volume && volume < 0))
+    error("activity bars of this type need a price and volume column");
+
+  const int *xi = (mode == REALSXP) ? NULL : INTEGER(_x);
+  const double *xr = (mode == REALSXP) ? REAL(_x) : NULL;
+
+  R_xlen_t cap = (nr < 1024) ? nr + 2 : 1024;
+  PROTECT_INDEX ipx;
+  SEXP _ep;
+  PROTECT_WITH_INDEX(_ep = allocVector(INTSXP, cap), &ipx);
+  int *ep = INTEGER(_ep);
+  R_xlen_t n = 0;
+  ep[n++] = 0;
+
+  double activity = 0, last_price = NA_REAL;
+  int sign = 0;
+  for (R_xlen_t i = 0; i < nr; i++) {
+    double p = need_price ? activity_value(xi, xr, nr, price, i) : 0;
+    double v = need_volume ? activity_value(xi, xr, nr, volume, i) : 1;
+    if (type >= ACT_TICK_IMBALANCE && !ISNAN(p)) {
+      /* tick rule: unchanged prices keep the previous sign */
+      if (!ISNAN(last_price) && p != last_price)
+        sign = (p > last_price) ? 1 : -1;
+      last_price = p;
+    }
+
+    double a;
+    switch (type) {
+      case ACT_TICKS:            a = 1; break;
+      case ACT_VOLUME:           a = v; break;
+      case ACT_DOLLARS:          a = p * v; break;
+      case ACT_TICK_IMBALANCE:   a = sign; break;
+      case ACT_VOLUME_IMBALANCE: a = sign * v; break;
+      default:                   a = sign * p * v; break;
+    }
+    if (ISNAN(a)) a = 0;
+    activity += a;
+
+    int close;
+    if (type < ACT_TICK_IMBALANCE) {
+      close = (activity >= threshold);
+      if (close) activity -= threshold;
+    } else {
+      close = (fabs(activity) >= threshold);
+      if (close) activity = 0;
+    }
+    if (close && i + 1 < nr) {
+      ep = ep_push(&_ep, ipx, ep, &n, (int)(i + 1));
+    }
+  }
+  if (ep[n - 1] != nr) {
+    ep = ep_push(&_ep, ipx, ep, &n, (int)nr);
+  }
+
+  REPROTECT(_ep = xlengthgets(_ep, n), ipx);
+  UNPROTECT(1);
+  return _ep;
+}
+
+/*
+ * Civil time fields of an index, as in as.POSIXlt(), without creating the
+ * POSIXlt. The local time comes from the cached offset table used by
+ * calendar_endpoints(), and the date is only recomputed when the local day
+ * changes. Several fields can be computed in one pass over the index.
+ */
+enum { FLD_SEC, FLD_MIN, FLD_HOUR, FLD_MDAY, FLD_MON, FLD_YEAR, FLD_WDAY,
+       FLD_YDAY, FLD_COUNT };
+
+static int index_field(const char *field)
+{
+  static const char *names[FLD_COUNT] =
+    { "sec", "min", "hour", "mday", "mon", "year", "wday", "yday" };
+  for (int f = 0; f < FLD_COUNT; f++) {
+    if (0 == strcmp(field, names[f])) return f;
+  }
+  error("unsupported index field '%s'", field);
+  return -1; /* not reached */
+}
+
+SEXP index_fields(SEXP _x, SEXP _fields, SEXP _tzoffsets)
+{
+  int P = 0;
+  R_xlen_t nr = xlength(_x);
+  int type = TYPEOF(_x);
+  if (type != INTSXP && type != REALSXP) error("unsupported 'x' type");
+  if (TYPEOF(_fields) != STRSXP) error("'fields' must be character");
+
+  int nfields = length(_fields);
+  int *which = (int *) R_alloc(nfields, sizeof(int));
+  void *out[FLD_COUNT] = { NULL };
+
+  SEXP _result = PROTECT(allocVector(VECSXP, nfields)); P++;
+  for (int f = 0; f < nfields; f++) {
+    which[f] = index_field(CHAR(STRING_ELT(_fields, f)));
+    if (out[which[f]] != NULL)
+      error("duplicate index field '%s'", CHAR(STRING_ELT(_fields, f)));
+    SEXP _field = allocVector(which[f] == FLD_SEC ? REALSXP : INTSXP, nr);
+    SET_VECTOR_ELT(_result, f, _field);
+    if (which[f] == FLD_SEC) {
+      out[FLD_SEC] = REAL(_field);
+    } else {
+      out[which[f]] = INTEGER(_field);
+    }
+  }
+  setAttrib(_result, R_NamesSymbol, _fields);
+
+  struct tz_offsets tz;
+  tz_offsets_init(_tzoffsets, &tz);
+
+  int *int_index = (type == INTSXP) ? INTEGER(_x) : NULL;
+  const double *real_index = (type == REALSXP) ? xts_real_values(_x) : NULL;
+  /* nanosecond index: whole seconds are exact, see int64.c */
+  const int64_t *int64_index = NULL;
+  if (xts_is_integer64(_x)) {
+    int64_index = (const int64_t *) REAL(_x);
+    real_index = NULL;
+  }
+
+  double *sec = out[FLD_SEC];
+  int *min = out[FLD_MIN], *hour = out[FLD_HOUR], *mday = out[FLD_MDAY],
+      *mon = out[FLD_MON], *year = out[FLD_YEAR], *wday = out[FLD_WDAY],
+      *yday = out[FLD_YDAY];
+  int need_date = mday || mon || year || yday;
+
+  int nthreads = (nr > 2 * ENDPOINTS_MIN_CHUNK) ? xts_get_num_threads() : 1;
+
+#ifdef _OPENMP
+#pragma omp parallel num_threads(nthreads) firstprivate(tz)
+#endif
+  {
+    /* date fields of the local day 'cur_day' */
+    int64_t cur_day = INT64_MIN;
+    int cur_mday = 0, cur_mon = 0, cur_year = 0, cur_yday = 0;
+
+#ifdef _OPENMP
+#pragma omp for schedule(static)
+#endif
+    for (R_xlen_t i = 0; i < nr; i++) {
+      double t, frac = 0;
+      if (int_index) {
+        t = (int_index[i] == NA_INTEGER) ? NA_REAL : (double)int_index[i];
+      } else if (int64_index) {
+        if (int64_index[i] == INT64_MIN) {
+          t = NA_REAL;
+        } else {
+          int64_t whole_sec = floor_div(int64_index[i], 1000000000);
+          t = (double)whole_sec;
+          frac = (double)(int64_index[i] - whole_sec * 1000000000) / 1e9;
+        }
+      } else {
+        t = real_index[i];
+      }
+
+      if (!R_FINITE(t) || fabs(t) > INDEX_FIELD_MAX_SECONDS) {
+        if (sec)  sec[i]  = NA_REAL;
+        if (min)  min[i]  = NA_INTEGER;
+        if (hour) hour[i] = NA_INTEGER;
+        if (mday) mday[i] = NA_INTEGER;
+        if (mon)  mon[i]  = NA_INTEGER;
+        if (year) year[i] = NA_INTEGER;
+        if (wday) wday[i] = NA_INTEGER;
+        if (yday) yday[i] = NA_INTEGER;
+        continue;
+      }
+
+      double local = tz_local(&tz, t);
+      double day_floor = floor(local / 86400.0);
+      int64_t day = (int64_t)day_floor;
+      double s = local - day_floor * 86400.0;   /* seconds into the day */
+      if (s < 0) {
+        /* rounding in local / 86400 for fractional seconds */
+        day--;
+        s += 86400.0;
+      } else if (s >= 86400.0) {
+        day++;
+        s -= 86400.0;
+      }
+      int64_t whole = (int64_t)floor(s);
+
+      if (sec)  sec[i]  = s - (double)(whole / 60 * 60) + frac;
+      if (min)  min[i]  = (int)(whole / 60 % 60);
+      if (hour) hour[i] = (int)(whole / 3600);
+      /* 1970-01-01 was a Thursday */
+      if (wday) wday[i] = (int)((day % 7 + 11) % 7);
+
+      if (need_date) {
+        if (day != cur_day) {
+          struct civil_date date;
+          xts_civil_date(day, &date);
+          cur_mday = date.mday;
+          cur_mon = date.mon - 1;
+          cur_year = date.year - 1900;
+          cur_yday = date.yday;
+          cur_day = day;
+        }
+        if (mday) mday[i] = cur_mday;
+        if (mon)  mon[i]  = cur_mon;
+        if (year) year[i] = cur_year;
+        if (yday) yday[i] = cur_yday;
+      }
+    }
+  }
+
+  UNPROTECT(P);
+  return _result;
+}
+
+/*
+ * Endpoints of a nanosecond (integer64) index, for periods of a fixed
+ * number of nanoseconds. The boundaries use exact integer arithmetic, so
+ * observations a nanosecond apart are never put in the same bucket because
+ * of rounding. See int64.c.
+ */
+SEXP endpoints_int64(SEXP _x, SEXP _on, SEXP _k, SEXP _offset)
+{
+  if (!xts_is_integer64(_x)) error("'x' must be integer64");
+  R_xlen_t nr = xlength(_x);
+  if (nr > INT_MAX) error("'x' has more than INT_MAX observations");
+
+  double on_ns = asReal(_on), offset_ns = asReal(_offset);
+  int k = asInteger(_k);
+  if (k == NA_INTEGER || k <= 0) error("'k' must be > 0");
+  if (!R_FINITE(on_ns) || on_ns < 1 || on_ns > (double)(INT64_MAX / k))
+    error("invalid period");
+  int64_t period = (int64_t)on_ns * k;
+  int64_t offset = (int64_t)offset_ns;
+
+  const int64_t *x = (const int64_t *) REAL(_x);
+  SEXP _ep = PROTECT(allocVector(INTSXP, nr + 2));
+  int *ep = INTEGER(_ep);
+  R_xlen_t n = 0;
+
+  ep[n++] = 0;
+  if (nr > 0) {
+    if (x[0] == INT64_MIN) error("'x' contains NA");
+    int64_t prev = floor_div(x[0] + offset, period);
+    for (R_xlen_t i = 1; i < nr; i++) {
+      if (x[i] == INT64_MIN) error("'x' contains NA");
+      int64_t key = floor_div(x[i] + offset, period);
+      if (key != prev) ep[n++] = (int)i;
+      prev = key;
+    }
+    if (ep[n - 1] != nr) ep[n++] = (int)nr;
+  }
+
+  _ep = lengthgets(_ep, n);
+  UNPROTECT(1);
+  return _ep;
+}
@@ -95,6 +95,9 @@ void R_init_xts(DllInfo *info)
 
   R_useDynamicSymbols(info, TRUE);
 
+  xts_init_altrep(info);
+  xts_init_packed_index(info);
+
   /* used by external packages linking to internal xts code from C */
   R_RegisterCCallable("xts","do_is_ordered",(DL_FUNC) &do_is_ordered);
   R_RegisterCCallable("xts","coredata_xts", (DL_FUNC) &coredata_xts);
@@ -107,6 +110,10 @@ void R_init_xts(DllInfo *info)
   R_RegisterCCallable("xts","make_index_unique", (DL_FUNC) &make_index_unique);
   R_RegisterCCallable("xts","make_unique",       (DL_FUNC) &make_unique);
   R_RegisterCCallable("xts","endpoints",         (DL_FUNC) &endpoints);
+  R_RegisterCCallable("xts","endpoints_tracker", (DL_FUNC) &endpoints_tracker);
+  R_RegisterCCallable("xts","endpoints_tracker_update", (DL_FUNC) &endpoints_tracker_update);
+  R_RegisterCCallable("xts","bar_builder",       (DL_FUNC) &bar_builder);
+  R_RegisterCCallable("xts","bar_builder_update", (DL_FUNC) &bar_builder_update);
   R_RegisterCCallable("xts","do_merge_xts",      (DL_FUNC) &do_merge_xts);
   R_RegisterCCallable("xts","na_omit_xts",       (DL_FUNC) &na_omit_xts);
   R_RegisterCCallable("xts","na_locf",           (DL_FUNC) &na_locf);
@@ -122,3 +129,9 @@ void R_init_xts(DllInfo *info)
   zoo_lag      = (SEXP(*)(SEXP,SEXP,SEXP)) R_GetCCallable("zoo","zoo_lag");
   zoo_coredata = (SEXP(*)(SEXP,SEXP))      R_GetCCallable("zoo","zoo_coredata");
 }
+
+void R_unload_xts(DllInfo *info)
+{
+  free_index_model();
+  free_civil_table();
+}
@@ -0,0 +1,114 @@
+/*
+#   xts: eXtensible time-series
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Nanosecond indexes. An index can be a bit64 "integer64" vector: a double
+ * vector whose 8-byte elements hold int64_t nanoseconds since the epoch.
+ * NA is INT64_MIN. xts does not need bit64 to handle these indexes in C.
+ *
+ * The bit patterns of non-negative int64_t values have the same order when
+ * they're compared as doubles, so kernels that only compare and copy index
+ * values (merge, rbind, subset, isOrdered) handle nanosecond indexes after
+ * 1970-01-01 without changes. Kernels that do arithmetic on the index
+ * (endpoints, binsearch) have int64_t branches.
+ */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <stdint.h>
+#include <math.h>
+#include "xts.h"
+
+#define NANOS_PER_SECOND 1000000000LL
+
+int xts_is_integer64(SEXP x)
+{
+  return TYPEOF(x) == REALSXP && inherits(x, "integer64");
+}
+
+/* Seconds since the epoch, as POSIXct, of a nanosecond index. Doubles can
+ * not represent every nanosecond, so this is only for output and calendar
+ * arithmetic. When '_floor' is TRUE, the fractional seconds are dropped
+ * exactly, before the conversion to double. */
+SEXP int64_to_seconds(SEXP _x, SEXP _floor)
+{
+  if (!xts_is_integer64(_x)) error("'x' must be integer64");
+  int whole = asLogical(_floor) == TRUE;
+  R_xlen_t i, n = xlength(_x);
+  const int64_t *x = (const int64_t *) REAL(_x);
+  SEXP _result = PROTECT(allocVector(REALSXP, n));
+  double *result = REAL(_result);
+
+  for (i = 0; i < n; i++) {
+    if (x[i] == INT64_MIN) {
+      result[i] = NA_REAL;
+      continue;
+    }
+    /* more accurate than converting the nanoseconds to double first */
+    int64_t s = x[i] / NANOS_PER_SECOND, ns = x[i] % NANOS_PER_SECOND;
+    if (ns < 0) {
+      s--;
+      ns += NANOS_PER_SECOND;
+    }
+    result[i] = (whole) ? (double)s : (double)s + (double)ns / 1e9;
+  }
+
+  UNPROTECT(1);
+  return _result;
+}
+
+/* Nanoseconds since the epoch of POSIXct seconds, rounded to the nearest
+ * nanosecond. Non-finite values and values out of range are NA. */
+SEXP int64_from_seconds(SEXP _x)
+{
+  int P = 0;
+  if (TYPEOF(_x) != REALSXP) {
+    PROTECT(_x = coerceVector(_x, REALSXP)); P++;
+  }
+  R_xlen_t i, n = xlength(_x);
+  const double *x = REAL(_x);
+  SEXP _result = PROTECT(allocVector(REALSXP, n)); P++;
+  int64_t *result = (int64_t *) REAL(_result);
+
+  for (i = 0; i < n; i++) {
+    double s = floor(x[i]);
+    if (!R_FINITE(x[i]) || fabs(s) >= 9.2e9) {
+      result[i] = INT64_MIN;
+      continue;
+    }
+    result[i] = (int64_t)s * NANOS_PER_SECOND +
+                (int64_t)llround((x[i] - s) * 1e9);
+  }
+
+  setAttrib(_result, R_ClassSymbol, mkString("integer64"));
+  UNPROTECT(P);
+  return _result;
+}
+
+/* merge and rbind compare the index values as doubles, which is only valid
+ * when both indexes are nanoseconds after the epoch */
+void xts_check_integer64_indexes(SEXP xindex, SEXP yindex)
+{
+  int x64 = xts_is_integer64(xindex), y64 = xts_is_integer64(yindex);
+  if (!x64 && !y64) return;
+  /* an empty index of the other type, e.g. from .xts(NULL, numeric()) */
+  if (x64 != y64 && xlength(x64 ? yindex : xindex) > 0)
+    error("can not combine a nanosecond (integer64) index with a numeric index");
+  if ((xlength(xindex) > 0 && ((const int64_t *) REAL(xindex))[0] < 0) ||
+      (xlength(yindex) > 0 && ((const int64_t *) REAL(yindex))[0] < 0))
+    error("nanosecond (integer64) indexes must not be before 1970-01-01");
+}
@@ -23,6 +23,7 @@
 #include<R.h>
 #include<Rdefines.h>
 #include<Rinternals.h>
+#include "xts.h"
 
 SEXP do_is_ordered (SEXP x, SEXP increasing, SEXP strictly)
 {
@@ -38,6 +39,14 @@ SEXP do_is_ordered (SEXP x, SEXP increasing, SEXP strictly)
     return ScalarLogical(1);
 
   if(TYPEOF(x) == REALSXP) {
+  /* a compact regular index is strictly increasing, and a packed index is
+   * increasing */
+  struct regular_index regular;
+  int strict_packed;
+  if(xts_regular_index(x, &regular))
+    return ScalarLogical(LOGICAL(increasing)[ 0 ] == 1);
+  if(xts_packed_index(x, &strict_packed) && LOGICAL(increasing)[ 0 ] == 1)
+    return ScalarLogical(strict_packed || LOGICAL(strictly)[ 0 ] != 1);
   /*
   Check for increasing order, strict or non-strict
   */
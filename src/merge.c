@@ -105,7 +105,8 @@ SEXP do_merge_xts (SEXP x, SEXP y,
   int *int_result=NULL, *int_x=NULL, *int_y=NULL, int_fill=0;
   int *int_index=NULL, *int_xindex=NULL, *int_yindex=NULL;
   double *real_result=NULL, *real_x=NULL, *real_y=NULL;
-  double *real_index=NULL, *real_xindex=NULL, *real_yindex=NULL;
+  double *real_index=NULL;
+  const double *real_xindex=NULL, *real_yindex=NULL;
 
   /* we do not check that 'x' is an xts object.  Dispatch and mergeXts
     (should) make this unecessary.  So we just get the index value 
@@ -181,6 +182,8 @@ SEXP do_merge_xts (SEXP x, SEXP y,
     return out;
   }
 
+  xts_check_integer64_indexes(xindex, yindex);
+
   /* at present we are failing the call if the indexing is of
      mixed type.  This should probably instead simply coerce
      to REAL so as not to lose any information (at the expense
@@ -208,8 +211,9 @@ SEXP do_merge_xts (SEXP x, SEXP y,
    */
   
   if( TYPEOF(xindex) == REALSXP ) { 
-  real_xindex = REAL(xindex);
-  real_yindex = REAL(yindex);
+  /* compact indexes are read without expanding them */
+  real_xindex = xts_real_values(xindex);
+  real_yindex = xts_real_values(yindex);
 
   /* Check for illegal values before looping. Due to ordered index,
    * -Inf must be first, while NA, Inf, and NaN must be last. */
@@ -1037,6 +1041,13 @@ SEXP do_merge_xts (SEXP x, SEXP y,
     setAttrib(result, R_DimSymbol, R_NilValue);
   }
 
+  /* merging regular series with the same spacing is often regular */
+  struct regular_index xregular, yregular;
+  if( xts_regular_index(xindex, &xregular) &&
+      xts_regular_index(yindex, &yregular) &&
+      xregular.step * xregular.by == yregular.step * yregular.by ) {
+    PROTECT(index = compact_index(index)); p++;
+  }
   setAttrib(result, xts_IndexSymbol, index);
   if(LOGICAL(retclass)[0])
     setAttrib(result, R_ClassSymbol, getAttrib(x, R_ClassSymbol));
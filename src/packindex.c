@@ -0,0 +1,503 @@
+/*
+#   xts: eXtensible time-series
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Block-compressed (packed) index.
+ *
+ * Tick indexes are sorted and the differences between consecutive values
+ * are small, so they can be stored in a few bits per value. Each value is
+ * an integer number of units of 1/scale seconds (scale is 1, 1e3, 1e6 or
+ * 1e9), and
+ *
+ *   index[i] = (double)u[i] / scale
+ *
+ * The values are split into blocks of PACK_BLOCK. Each block stores u of
+ * its first value, the smallest difference in the block ('dmin'), and the
+ * differences minus dmin, bit-packed in the smallest width that fits them
+ * (frame of reference). Regular blocks need 0 bits per value.
+ *
+ * The first value of each block is the block's fence: a search finds the
+ * block with a binary search over the fences, and then only decodes that
+ * block. Sequential scans (endpoints, merge) decode one block at a time
+ * with REAL_GET_REGION().
+ *
+ * An index is only packed if every value is exactly reproduced by the
+ * formula above, so the packed index has the same values as the original.
+ */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <Rversion.h>
+#include <R_ext/Rdynload.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "xts.h"
+
+#if defined(R_VERSION) && R_VERSION >= R_Version(3, 6, 0)
+#define XTS_HAVE_ALTREP 1
+#include <R_ext/Altrep.h>
+#endif
+
+#define PACK_BLOCK 128
+
+/* largest |u|, so differences fit in int64_t */
+#define PACK_MAX_UNITS 4.0e18
+
+/* layout of the RAWSXP in data1: the header, then int64_t base[nblocks],
+ * int64_t dmin[nblocks], uint64_t offset[nblocks], uint64_t words[nwords],
+ * and unsigned char width[nblocks] */
+struct pack_header {
+  double n;
+  double nblocks;
+  double nwords;
+  double scale;
+  int valid;      /* 0 after the values were modified in place */
+  int strict;     /* strictly increasing */
+};
+
+struct packed_index {
+  struct pack_header *h;
+  R_xlen_t n, nblocks;
+  double scale;
+  const int64_t *base;
+  const int64_t *dmin;
+  const uint64_t *offset;
+  const uint64_t *words;
+  const unsigned char *width;
+};
+
+static size_t pack_size(R_xlen_t nblocks, R_xlen_t nwords)
+{
+  return sizeof(struct pack_header) + 3 * nblocks * sizeof(int64_t) +
+    nwords * sizeof(uint64_t) + nblocks;
+}
+
+static void pack_view(SEXP raw, struct packed_index *p)
+{
+  unsigned char *data = RAW(raw);
+  struct pack_header *h = (struct pack_header *) data;
+  p->h = h;
+  p->n = (R_xlen_t)h->n;
+  p->nblocks = (R_xlen_t)h->nblocks;
+  p->scale = h->scale;
+  p->base = (const int64_t *)(data + sizeof(struct pack_header));
+  p->dmin = p->base + p->nblocks;
+  p->offset = (const uint64_t *)(p->dmin + p->nblocks);
+  p->words = p->offset + p->nblocks;
+  p->width = (const unsigned char *)(p->words + (R_xlen_t)h->nwords);
+}
+
+static inline uint64_t
+read_bits(const uint64_t *words, uint64_t pos, int width)
+{
+  if (width == 0) return 0;
+  uint64_t i = pos >> 6;
+  int shift = (int)(pos & 63);
+  uint64_t v = words[i] >> shift;
+  if (shift + width > 64) v |= words[i + 1] << (64 - shift);
+  return (width == 64) ? v : v & ((UINT64_C(1) << width) - 1);
+}
+
+static inline void
+write_bits(uint64_t *words, uint64_t pos, int width, uint64_t v)
+{
+  if (width == 0) return;
+  uint64_t i = pos >> 6;
+  int shift = (int)(pos & 63);
+  words[i] |= v << shift;
+  if (shift + width > 64) words[i + 1] |= v >> (64 - shift);
+}
+
+static inline int bit_width(uint64_t v)
+{
+  int w = 0;
+  while (v) {
+    w++;
+    v >>= 1;
+  }
+  return w;
+}
+
+/* Decode values [from, to) of block 'b' into 'out' */
+static void
+pack_decode(const struct packed_index *p, R_xlen_t b, int from, int to,
+            double *out)
+{
+  int64_t u = p->base[b], dmin = p->dmin[b];
+  int j, width = p->width[b];
+  const uint64_t *words = p->words + p->offset[b];
+  for (j = 0; j < to; j++) {
+    if (j > 0)
+      u += dmin + (int64_t)read_bits(words, (uint64_t)(j - 1) * width, width);
+    if (j >= from)
+      out[j - from] = (double)u / p->scale;
+  }
+}
+
+static inline int block_length(const struct packed_index *p, R_xlen_t b)
+{
+  R_xlen_t len = p->n - b * PACK_BLOCK;
+  return (len < PACK_BLOCK) ? (int)len : PACK_BLOCK;
+}
+
+static inline double fence(const struct packed_index *p, R_xlen_t b)
+{
+  return (double)p->base[b] / p->scale;
+}
+
+/* Smallest block whose fence is >= key (use_start) or > key, or nblocks */
+static R_xlen_t
+fence_search(const struct packed_index *p, double key, int use_start)
+{
+  R_xlen_t lo = 0, hi = p->nblocks;
+  while (lo < hi) {
+    R_xlen_t mid = lo + (hi - lo) / 2;
+    double f = fence(p, mid);
+    if ((use_start) ? f >= key : f > key) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
+/* Smallest i with index[i] >= key (use_start), or largest i with
+ * index[i] <= key. Returns -1 if there is none. */
+static R_xlen_t
+pack_search(const struct packed_index *p, double key, int use_start)
+{
+  double buf[PACK_BLOCK];
+  R_xlen_t b = fence_search(p, key, use_start);
+  int j, len;
+
+  if (use_start) {
+    /* the answer is in the previous block, or is the first value of 'b' */
+    if (b > 0) {
+      len = block_length(p, b - 1);
+      pack_decode(p, b - 1, 0, len, buf);
+      for (j = 0; j < len; j++) {
+        if (buf[j] >= key) return (b - 1) * PACK_BLOCK + j;
+      }
+    }
+    return (b < p->nblocks) ? b * PACK_BLOCK : -1;
+  }
+
+  /* the fence of the previous block is <= key */
+  if (b == 0) return -1;
+  len = block_length(p, b - 1);
+  pack_decode(p, b - 1, 0, len, buf);
+  for (j = len - 1; j > 0 && buf[j] > key; j--)
+    ;
+  return (b - 1) * PACK_BLOCK + j;
+}
+
+/* Pack the values of 'x' into a RAWSXP, or return NULL if they can't be
+ * packed exactly */
+static SEXP pack_values(const double *x, R_xlen_t n)
+{
+  static const double scales[] = { 1, 1e3, 1e6, 1e9 };
+  R_xlen_t i, b;
+  double scale = 0;
+  int s, strict = 1;
+
+  /* the smallest unit that reproduces every value */
+  for (s = 0; s < 4 && scale == 0; s++) {
+    double prev = R_NegInf;
+    strict = 1;
+    for (i = 0; i < n; i++) {
+      double units = nearbyint(x[i] * scales[s]);
+      if (!(fabs(units) < PACK_MAX_UNITS) ||
+          (double)(int64_t)units / scales[s] != x[i] || x[i] < prev)
+        break;
+      strict &= (x[i] > prev);
+      prev = x[i];
+    }
+    if (i == n) scale = scales[s];
+  }
+  if (scale == 0) return NULL;
+
+  R_xlen_t nblocks = (n - 1) / PACK_BLOCK + 1;
+  unsigned char *width = (unsigned char *) R_alloc(nblocks, 1);
+  int64_t *dmin = (int64_t *) R_alloc(nblocks, sizeof(int64_t));
+  uint64_t *offset = (uint64_t *) R_alloc(nblocks, sizeof(uint64_t));
+  uint64_t nwords = 0;
+
+  /* the width of each block, and where its bits start */
+  for (b = 0; b < nblocks; b++) {
+    R_xlen_t from = b * PACK_BLOCK, to = from + PACK_BLOCK;
+    if (to > n) to = n;
+    int64_t lo = INT64_MAX, hi = 0, prev = (int64_t)nearbyint(x[from] * scale);
+    for (i = from + 1; i < to; i++) {
+      int64_t u = (int64_t)nearbyint(x[i] * scale), d = u - prev;
+      if (d < lo) lo = d;
+      if (d > hi) hi = d;
+      prev = u;
+    }
+    if (to - from == 1) lo = hi = 0;
+    dmin[b] = lo;
+    width[b] = (unsigned char)bit_width((uint64_t)(hi - lo));
+    offset[b] = nwords;
+    nwords += ((uint64_t)(to - from - 1) * width[b] + 63) / 64;
+  }
+
+  SEXP raw = PROTECT(allocVector(RAWSXP, pack_size(nblocks, nwords)));
+  memset(RAW(raw), 0, XLENGTH(raw));
+  struct pack_header *h = (struct pack_header *) RAW(raw);
+  h->n = (double)n;
+  h->nblocks = (double)nblocks;
+  h->nwords = (double)nwords;
+  h->scale = scale;
+  h->valid = 1;
+  h->strict = strict;
+
+  struct packed_index p;
+  pack_view(raw, &p);
+  int64_t *base = (int64_t *) p.base;
+  uint64_t *words = (uint64_t *) p.words;
+  memcpy((int64_t *) p.dmin, dmin, nblocks * sizeof(int64_t));
+  memcpy((uint64_t *) p.offset, offset, nblocks * sizeof(uint64_t));
+  memcpy((unsigned char *) p.width, width, nblocks);
+
+  for (b = 0; b < nblocks; b++) {
+    R_xlen_t from = b * PACK_BLOCK, to = from + PACK_BLOCK;
+    if (to > n) to = n;
+    int64_t prev = (int64_t)nearbyint(x[from] * scale);
+    base[b] = prev;
+    for (i = from + 1; i < to; i++) {
+      int64_t u = (int64_t)nearbyint(x[i] * scale);
+      write_bits(words + offset[b], (uint64_t)(i - from - 1) * width[b],
+                 width[b], (uint64_t)(u - prev - dmin[b]));
+      prev = u;
+    }
+  }
+
+  UNPROTECT(1);
+  return raw;
+}
+
+#ifdef XTS_HAVE_ALTREP
+
+static R_altrep_class_t packed_index_class;
+
+static void packed_view(SEXP x, struct packed_index *p)
+{
+  pack_view(R_altrep_data1(x), p);
+}
+
+static int packed_valid(SEXP x)
+{
+  return ((struct pack_header *) RAW(R_altrep_data1(x)))->valid;
+}
+
+static R_xlen_t packed_Length(SEXP x)
+{
+  return (R_xlen_t)((struct pack_header *) RAW(R_altrep_data1(x)))->n;
+}
+
+static R_xlen_t
+packed_Get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf)
+{
+  R_xlen_t len = packed_Length(x);
+  if (i + n > len) n = len - i;
+  SEXP values = R_altrep_data2(x);
+  if (values != R_NilValue) {
+    memcpy(buf, REAL(values) + i, n * sizeof(double));
+    return n;
+  }
+  struct packed_index p;
+  packed_view(x, &p);
+  R_xlen_t k = 0;
+  while (k < n) {
+    R_xlen_t b = (i + k) / PACK_BLOCK;
+    int from = (int)((i + k) - b * PACK_BLOCK);
+    int to = block_length(&p, b);
+    if (to - from > n - k) to = from + (int)(n - k);
+    pack_decode(&p, b, from, to, buf + k);
+    k += to - from;
+  }
+  return n;
+}
+
+static double packed_Elt(SEXP x, R_xlen_t i)
+{
+  double v;
+  packed_Get_region(x, i, 1, &v);
+  return v;
+}
+
+static void *packed_Dataptr(SEXP x, Rboolean writeable)
+{
+  SEXP values = R_altrep_data2(x);
+  if (values == R_NilValue) {
+    R_xlen_t n = packed_Length(x);
+    values = PROTECT(allocVector(REALSXP, n));
+    packed_Get_region(x, 0, n, REAL(values));
+    R_set_altrep_data2(x, values);
+    UNPROTECT(1);
+  }
+  /* the caller may change the values */
+  if (writeable) ((struct pack_header *) RAW(R_altrep_data1(x)))->valid = 0;
+  return REAL(values);
+}
+
+static const void *packed_Dataptr_or_null(SEXP x)
+{
+  SEXP values = R_altrep_data2(x);
+  return (values == R_NilValue) ? NULL : REAL(values);
+}
+
+static int packed_Is_sorted(SEXP x)
+{
+  return packed_valid(x) ? SORTED_INCR : UNKNOWN_SORTEDNESS;
+}
+
+static int packed_No_NA(SEXP x)
+{
+  return packed_valid(x);
+}
+
+static SEXP packed_Duplicate(SEXP x, Rboolean deep)
+{
+  /* NULL uses the default method, which copies the values */
+  if (!packed_valid(x)) return NULL;
+  SEXP raw = PROTECT(duplicate(R_altrep_data1(x)));
+  SEXP result = R_new_altrep(packed_index_class, raw, R_NilValue);
+  UNPROTECT(1);
+  return result;
+}
+
+static SEXP packed_Serialized_state(SEXP x)
+{
+  /* the packed layout depends on the platform's byte order, so the values
+   * are serialized like an ordinary vector */
+  return NULL;
+}
+
+static Rboolean
+packed_Inspect(SEXP x, int pre, int deep, int pvec,
+               void (*inspect_subtree)(SEXP, int, int, int))
+{
+  struct packed_index p;
+  packed_view(x, &p);
+  Rprintf(" xts packed index (n=%.0f, blocks=%.0f, bytes=%.0f%s)\n",
+          (double)p.n, (double)p.nblocks,
+          (double)XLENGTH(R_altrep_data1(x)),
+          packed_valid(x) ? "" : ", modified");
+  return TRUE;
+}
+
+void xts_init_packed_index(DllInfo *info)
+{
+  packed_index_class = R_make_altreal_class("xts_packed_index", "xts", info);
+  R_altrep_class_t cls = packed_index_class;
+  R_set_altrep_Length_method(cls, packed_Length);
+  R_set_altrep_Duplicate_method(cls, packed_Duplicate);
+  R_set_altrep_Serialized_state_method(cls, packed_Serialized_state);
+  R_set_altrep_Inspect_method(cls, packed_Inspect);
+  R_set_altvec_Dataptr_method(cls, packed_Dataptr);
+  R_set_altvec_Dataptr_or_null_method(cls, packed_Dataptr_or_null);
+  R_set_altreal_Elt_method(cls, packed_Elt);
+  R_set_altreal_Get_region_method(cls, packed_Get_region);
+  R_set_altreal_Is_sorted_method(cls, packed_Is_sorted);
+  R_set_altreal_No_NA_method(cls, packed_No_NA);
+}
+
+static int xts_packed_view(SEXP x, struct packed_index *p)
+{
+  if (!ALTREP(x) || !R_altrep_inherits(x, packed_index_class) ||
+      !packed_valid(x))
+    return 0;
+  packed_view(x, p);
+  return 1;
+}
+
+static SEXP packed_new(SEXP raw)
+{
+  return R_new_altrep(packed_index_class, raw, R_NilValue);
+}
+
+#else /* no ALTREP */
+
+void xts_init_packed_index(DllInfo *info)
+{
+}
+
+static int xts_packed_view(SEXP x, struct packed_index *p)
+{
+  return 0;
+}
+
+static SEXP packed_new(SEXP raw)
+{
+  return R_NilValue;
+}
+
+#endif
+
+/* binsearch() on a packed index: decodes one block. Returns 0 if 'x' is
+ * not a packed index. '*result' is 1-based, or NA. */
+int xts_packed_search(SEXP x, double key, int use_start, int *result)
+{
+  struct packed_index p;
+  if (!xts_packed_view(x, &p)) return 0;
+  R_xlen_t i = pack_search(&p, key, use_start);
+  *result = (i < 0) ? NA_INTEGER : (int)(i + 1);
+  return 1;
+}
+
+/* 1 if 'x' is a packed index, and whether it's strictly increasing */
+int xts_packed_index(SEXP x, int *strict)
+{
+  struct packed_index p;
+  if (!xts_packed_view(x, &p)) return 0;
+  if (strict) *strict = p.h->strict;
+  return 1;
+}
+
+/* The index 'x', packed if its values are sorted and can be stored exactly.
+ * Other indexes are returned unchanged. */
+SEXP pack_index(SEXP x)
+{
+  R_xlen_t n = xlength(x);
+  int strict;
+
+  if (TYPEOF(x) != REALSXP || n < 2 || xts_is_integer64(x) ||
+      xts_packed_index(x, &strict))
+    return x;
+
+  const double *v = xts_real_values(x);
+  SEXP raw = pack_values(v, n);
+  if (raw == NULL) return x;
+  PROTECT(raw);
+  SEXP result = packed_new(raw);
+  if (result == R_NilValue) {
+    UNPROTECT(1);
+    return x;
+  }
+  PROTECT(result);
+  SHALLOW_DUPLICATE_ATTRIB(result, x);
+  UNPROTECT(2);
+  return result;
+}
+
+/* TRUE if 'x' is a packed index */
+SEXP is_packed_index(SEXP x)
+{
+  return ScalarLogical(xts_packed_index(x, NULL));
+}
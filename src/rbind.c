@@ -41,7 +41,8 @@ SEXP do_rbind_xts (SEXP x, SEXP y, SEXP dup)
   int *int_result=NULL, *int_x=NULL, *int_y=NULL;
   int *int_newindex=NULL, *int_xindex=NULL, *int_yindex=NULL;
   double *real_result=NULL, *real_x=NULL, *real_y=NULL;
-  double *real_newindex=NULL, *real_xindex=NULL, *real_yindex=NULL;
+  double *real_newindex=NULL;
+  const double *real_xindex=NULL, *real_yindex=NULL;
 
   nrx = nrows(x);
   ncx = ncols(x);
@@ -79,7 +80,7 @@ SEXP do_rbind_xts (SEXP x, SEXP y, SEXP dup)
 
   PROTECT(xindex = getAttrib(x, xts_IndexSymbol)); P++;
   PROTECT(yindex = getAttrib(y, xts_IndexSymbol)); P++;
-
+  xts_check_integer64_indexes(xindex, yindex);
 
   if( TYPEOF(xindex) != TYPEOF(yindex) ) 
   {
@@ -153,8 +154,8 @@ return(result);
   */
   if( TYPEOF(xindex) == REALSXP ) {
   real_newindex = REAL(newindex);
-  real_xindex = REAL(xindex);
-  real_yindex = REAL(yindex);
+  real_xindex = xts_real_values(xindex);
+  real_yindex = xts_real_values(yindex);
   for( i = 0; i < len; i++ ) {
     if( i >= truelen ) {
       break;
@@ -631,8 +632,8 @@ SEXP rbind_append (SEXP x, SEXP y) {
   if(INDEXTYPE != NILSXP) {
     PROTECT(index = allocVector(INDEXTYPE, nr));
     if(INDEXTYPE==REALSXP) {
-      memcpy(REAL(index), REAL(xindex), nrs_x * sizeof(double));
-      memcpy(&(REAL(index)[nrs_x]), REAL(yindex), nrs_y * sizeof(double));
+      memcpy(REAL(index), xts_real_values(xindex), nrs_x * sizeof(double));
+      memcpy(&(REAL(index)[nrs_x]), xts_real_values(yindex), nrs_y * sizeof(double));
     } else
     if(INDEXTYPE==INTSXP) {
       memcpy(INTEGER(index), INTEGER(xindex), nrs_x * sizeof(int));
@@ -22,6 +22,8 @@
 
 #include <R.h>
 #include <Rinternals.h>
+#include <string.h>
+#include <limits.h>
 #include "xts.h"
 
 
@@ -113,307 +115,740 @@ static SEXP xts_ExtractSubset(SEXP x, SEXP result, SEXP indx) //, SEXP call)
     return result;
 }
 
-SEXP _do_subset_xts (SEXP x, SEXP sr, SEXP sc, SEXP drop) {
-  SEXP result;
-  int i, j, nr, nc, nrs, ncs;
-  int P=0;
+/* Build a compact row descriptor for 'n' rows: from, from+by, from+2*by, ...
+ * The descriptor is an integer vector c(from, by, n) with class "xts_rows".
+ */
+static SEXP xts_row_range(int from, int by, int n)
+{
+  SEXP result = PROTECT(allocVector(INTSXP, 3));
+  INTEGER(result)[0] = from;
+  INTEGER(result)[1] = by;
+  INTEGER(result)[2] = n;
+  setAttrib(result, R_ClassSymbol, mkString("xts_rows"));
+  UNPROTECT(1);
+  return result;
+}
 
-  SEXP Dim = getAttrib(x, R_DimSymbol);
-  nrs = nrows(x);ncs = ncols(x);
-  nr = length(sr); nc = length(sc);
+/* Expand a compact row descriptor or a logical mask (see xts_row_index())
+ * into an integer vector of rows */
+SEXP xts_expand_rows(SEXP rows)
+{
+  if (TYPEOF(rows) == LGLSXP) {
+    R_xlen_t k, n = xlength(rows), count = 0;
+    const int *mask = LOGICAL(rows);
+    for (k = 0; k < n; k++)
+      count += (mask[k] == 1);
+    SEXP result = PROTECT(allocVector(INTSXP, count));
+    int *res = INTEGER(result);
+    for (k = 0, count = 0; k < n; k++) {
+      if (mask[k] == 1)
+        res[count++] = (int)(k + 1);
+    }
+    UNPROTECT(1);
+    return result;
+  }
+  if (!inherits(rows, "xts_rows")) {
+    return rows;
+  }
+  int i, from = INTEGER(rows)[0], by = INTEGER(rows)[1], n = INTEGER(rows)[2];
+  SEXP result = PROTECT(allocVector(INTSXP, n));
+  int *res = INTEGER(result);
+  for (i = 0; i < n; i++) {
+    res[i] = from + i * by;
+  }
+  UNPROTECT(1);
+  return result;
+}
 
-  SEXP oindex, nindex;
-  oindex = getAttrib(x, xts_IndexSymbol);
-  PROTECT(nindex = allocVector(TYPEOF(oindex), nr)); P++;
-  PROTECT(result = allocVector(TYPEOF(x), nr*nc)); P++;
-  j = 0;
+/* Rows excluded by negative subscripts. 'excl' contains the sorted, absolute
+ * values of the negative subscripts. Returns the number of unique excluded
+ * rows in [1, nr], and moves them to the front of 'excl'.
+ */
+static int unique_excluded_rows(int *excl, int n, int nr)
+{
+  int i, m = 0;
+  for (i = 0; i < n; i++) {
+    if (excl[i] > nr) break;
+    if (m > 0 && excl[i] == excl[m-1]) continue;
+    excl[m++] = excl[i];
+  }
+  return m;
+}
 
-  double *real_nindex=NULL, *real_oindex, *real_result=NULL, *real_x=NULL; 
-  int *int_nindex=NULL, *int_oindex, *int_result=NULL, *int_x=NULL; 
-  int *int_sr=NULL, *int_sc=NULL;
-  int_sr = INTEGER(sr);
-  int_sc = INTEGER(sc);
+/* Validate and normalize a numeric or logical row subscript 'i' for an
+ * object with 'nr' rows in (usually) one pass: drop zeros, resolve negative
+ * subscripts, check for NA and bounds, and sort. This replaces the chain of
+ * any_negative(), max(), isOrdered(), sort(), binsearch() and which() calls
+ * in [.xts.
+ *
+ * Returns a compact row descriptor (see xts_row_range()) when the rows are
+ * evenly spaced, so contiguous and strided subsets don't allocate a vector
+ * of row numbers. Other logical subscripts are returned unchanged, and
+ * _do_subset_xts() compacts the data with the mask directly. Otherwise
+ * returns a sorted integer vector of rows.
+ */
+SEXP xts_row_index(SEXP _i, SEXP _nr)
+{
+  R_xlen_t k, n = xlength(_i);
+  int nr = asInteger(_nr);
+  int row, first = 0, prev = 0, by = 0, count = 0;
+  int regular = 1, sorted = 1, has_zero = 0, has_neg = 0, has_pos = 0;
 
-  copyAttributes(x, result);
+  SEXP result;
 
-  if(TYPEOF(x)==LGLSXP) {
-    int_x = LOGICAL(x); 
-    int_result = LOGICAL(result); 
-    if(TYPEOF(nindex)==INTSXP) {
-      int_nindex = INTEGER(nindex);
-      int_oindex = INTEGER(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        int_nindex[i] = int_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          int_result[i+j*nr] = NA_INTEGER;
-        else
-          int_result[i+j*nr] = int_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
-      }
-    } else
-    if(TYPEOF(nindex)==REALSXP) {
-      real_nindex = REAL(nindex);
-      real_oindex = REAL(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        real_nindex[i] = real_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          int_result[i+j*nr] = NA_INTEGER;
-        else
-          int_result[i+j*nr] = int_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+  if (n == 0)
+    return allocVector(INTSXP, 0);
+
+  if (TYPEOF(_i) == LGLSXP) {
+    /* like which(i), but without recycling (see [.xts) */
+    int *lgl_i = LOGICAL(_i);
+    R_xlen_t len = (n > nr) ? nr : n;
+    for (k = nr; k < n; k++) {
+      if (lgl_i[k] == 1)
+        error("subscript out of bounds");
+    }
+    /* stop looking for evenly-spaced rows at the first irregular one */
+    for (k = 0; k < len && regular; k++) {
+      if (lgl_i[k] != 1)
+        continue;
+      row = (int)(k + 1);
+      if (count == 0) {
+        first = row;
+      } else if (count == 1) {
+        by = row - prev;
+      } else if (row - prev != by) {
+        regular = 0;
       }
+      prev = row;
+      count++;
     }
-    copyAttributes(oindex, nindex);
-    setAttrib(result, xts_IndexSymbol, nindex);
-    for(j=1; j<nc; j++) {
-      for(i=0; i<nr; i++) {
-        if(int_sc[j] == NA_INTEGER)
-          int_result[i+j*nr] = NA_INTEGER;
-        else
-          int_result[i+j*nr] = int_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+    if (count == 0)
+      return allocVector(INTSXP, 0);
+    if (regular)
+      return xts_row_range(first, (count == 1) ? 1 : by, count);
+
+    return _i;
+  }
+
+  if (TYPEOF(_i) != INTSXP && TYPEOF(_i) != REALSXP)
+    error("unsupported 'i' type");
+
+  int *int_i = NULL;
+  double *real_i = NULL;
+  if (TYPEOF(_i) == INTSXP) {
+    int_i = INTEGER(_i);
+  } else {
+    real_i = REAL(_i);
+  }
+
+  /* classify all elements, and track sortedness and spacing of positive
+   * elements in the same pass
+   */
+  for (k = 0; k < n; k++) {
+    if (int_i) {
+      if (int_i[k] == NA_INTEGER)
+        error("'i' contains NA");
+      row = int_i[k];
+    } else {
+      double d = real_i[k];
+      if (ISNAN(d))
+        error("'i' contains NA");
+      if (d > nr)
+        error("subscript out of bounds");
+      if (d < 0) {
+        has_neg = 1;
+        continue;
       }
+      row = (int)d;
     }
-  } else
-  /* branch into INTSXP and REALSXP, as these are most
-     common/important types for time series data 
-  */
-  if(TYPEOF(x)==INTSXP) {
-    int_x = INTEGER(x); 
-    int_result = INTEGER(result); 
-    if(TYPEOF(nindex)==INTSXP) {
-      int_nindex = INTEGER(nindex);
-      int_oindex = INTEGER(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        int_nindex[i] = int_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          int_result[i+j*nr] = NA_INTEGER;
-        else
-          int_result[i+j*nr] = int_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+    if (row < 0) {
+      has_neg = 1;
+      continue;
+    }
+    if (row == 0) {
+      has_zero = 1;
+      continue;
+    }
+    if (row > nr)
+      error("subscript out of bounds");
+    has_pos = 1;
+
+    if (count == 0) {
+      first = row;
+    } else {
+      if (row < prev) {
+        sorted = 0;
       }
-    } else
-    if(TYPEOF(nindex)==REALSXP) {
-      real_nindex = REAL(nindex);
-      real_oindex = REAL(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        real_nindex[i] = real_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          int_result[i+j*nr] = NA_INTEGER;
-        else
-          int_result[i+j*nr] = int_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+      if (count == 1) {
+        by = row - prev;
+      } else if (row - prev != by) {
+        regular = 0;
       }
     }
-    copyAttributes(oindex, nindex);
-    setAttrib(result, xts_IndexSymbol, nindex);
+    prev = row;
+    count++;
+  }
 
-    /* loop through remaining columns */
-    for(j=1; j<nc; j++) {
-      for(i=0; i<nr; i++) {
-        if(int_sc[j] == NA_INTEGER)
-          int_result[i+j*nr] = NA_INTEGER;
-        else
-          int_result[i+j*nr] = int_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+  if (has_neg && has_pos)
+    error("only zeros may be mixed with negative subscripts");
+
+  if (has_neg) {
+    /* keep all rows except the excluded ones */
+    PROTECT(result = allocVector(INTSXP, n));
+    int *excl = INTEGER(result);
+    int m = 0;
+    for (k = 0; k < n; k++) {
+      if (int_i) {
+        row = int_i[k];
+      } else {
+        row = (real_i[k] < -nr) ? -(nr + 1) : (int)real_i[k];
       }
+      if (row < 0)
+        excl[m++] = (row < -nr) ? nr + 1 : -row;
     }
-  } else
-  if(TYPEOF(x)==REALSXP) {
-    real_x = REAL(x);
-    real_result = REAL(result);
-    if(TYPEOF(nindex)==INTSXP) {
-      int_nindex = INTEGER(nindex);
-      int_oindex = INTEGER(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        int_nindex[i] = int_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          real_result[i+j*nr] = NA_REAL;
-        else
-          real_result[i+j*nr] = real_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
-      }
-    } else
-    if(TYPEOF(nindex)==REALSXP) {
-      real_nindex = REAL(nindex);
-      real_oindex = REAL(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        real_nindex[i] = real_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          real_result[i+j*nr] = NA_REAL;
-        else
-          real_result[i+j*nr] = real_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
-      }
+    R_qsort_int(excl, 1, m);
+    m = unique_excluded_rows(excl, m, nr);
+
+    if (m == nr) {
+      UNPROTECT(1);
+      return allocVector(INTSXP, 0);
     }
-    copyAttributes(oindex, nindex);
-    setAttrib(result, xts_IndexSymbol, nindex);
 
-    for(j=1; j<nc; j++) {
-      for(i=0; i<nr; i++) {
-        if(int_sc[j] == NA_INTEGER)
-          real_result[i+j*nr] = NA_REAL;
-        else
-          real_result[i+j*nr] = real_x[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
-      }
+    /* kept rows are contiguous if the excluded rows are only at the start
+     * and/or end of the object
+     */
+    int head = 0;
+    while (head < m && excl[head] == head + 1)
+      head++;
+    int tail = m - head;
+    if (tail == 0 || excl[head] == nr - tail + 1) {
+      UNPROTECT(1);
+      return xts_row_range(head + 1, 1, nr - m);
     }
-  } else
-  if(TYPEOF(x)==CPLXSXP) {
-    /*
-    real_x = REAL(x);
-    real_result = REAL(result);
-    */
-    if(TYPEOF(nindex)==INTSXP) {
-      int_nindex = INTEGER(nindex);
-      int_oindex = INTEGER(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        int_nindex[i] = int_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER) {
-          COMPLEX(result)[i+j*nr].r = NA_REAL;
-          COMPLEX(result)[i+j*nr].i = NA_REAL;
-        } else
-          COMPLEX(result)[i+j*nr] = COMPLEX(x)[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
-      }
-    } else
-    if(TYPEOF(nindex)==REALSXP) {
-      real_nindex = REAL(nindex);
-      real_oindex = REAL(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        real_nindex[i] = real_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER) {
-          COMPLEX(result)[i+j*nr].r = NA_REAL;
-          COMPLEX(result)[i+j*nr].i = NA_REAL;
-        } else
-          COMPLEX(result)[i+j*nr] = COMPLEX(x)[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+
+    SEXP rows = PROTECT(allocVector(INTSXP, nr - m));
+    int *res = INTEGER(rows);
+    int e = 0, j = 0;
+    for (row = 1; row <= nr; row++) {
+      if (e < m && excl[e] == row) {
+        e++;
+        continue;
       }
+      res[j++] = row;
     }
-    copyAttributes(oindex, nindex);
-    setAttrib(result, xts_IndexSymbol, nindex);
+    UNPROTECT(2);
+    return rows;
+  }
 
-    for(j=1; j<nc; j++) {
-      for(i=0; i<nr; i++) {
-        if(int_sc[j] == NA_INTEGER) {
-          COMPLEX(result)[i+j*nr].r = NA_REAL;
-          COMPLEX(result)[i+j*nr].i = NA_REAL;
-        } else
-          COMPLEX(result)[i+j*nr] = COMPLEX(x)[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
-      }
+  if (count == 0)
+    return allocVector(INTSXP, 0);
+
+  if (sorted && regular && (count == 1 || by > 0))
+    return xts_row_range(first, (count == 1) ? 1 : by, count);
+
+  /* avoid a copy when 'i' is already a clean, sorted integer vector */
+  if (sorted && !has_zero && int_i && ATTRIB(_i) == R_NilValue)
+    return _i;
+
+  PROTECT(result = allocVector(INTSXP, count));
+  int *res = INTEGER(result);
+  int j = 0;
+  for (k = 0; k < n; k++) {
+    row = (int_i) ? int_i[k] : (int)real_i[k];
+    if (row > 0)
+      res[j++] = row;
+  }
+
+  if (!sorted) {
+    R_qsort_int(res, 1, count);
+
+    /* check whether the sorted rows are evenly spaced */
+    by = (count > 1) ? res[1] - res[0] : 1;
+    regular = by > 0;
+    for (j = 2; regular && j < count; j++) {
+      regular = (res[j] - res[j-1] == by);
     }
-  } else
-  if(TYPEOF(x)==STRSXP) {
-    if(TYPEOF(nindex)==INTSXP) {
-      int_nindex = INTEGER(nindex);
-      int_oindex = INTEGER(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        int_nindex[i] = int_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          SET_STRING_ELT(result, i+j*nr, NA_STRING);
-        else
-          SET_STRING_ELT(result, i+j*nr, STRING_ELT(x, int_sr[i]-1 + ((int_sc[j]-1) * nrs)));
-      }
-    } else
-    if(TYPEOF(nindex)==REALSXP) {
-      real_nindex = REAL(nindex);
-      real_oindex = REAL(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        real_nindex[i] = real_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          SET_STRING_ELT(result, i+j*nr, NA_STRING);
-        else
-          SET_STRING_ELT(result, i+j*nr, STRING_ELT(x, int_sr[i]-1 + ((int_sc[j]-1) * nrs)));
-      }
+    if (regular) {
+      UNPROTECT(1);
+      return xts_row_range(res[0], by, count);
     }
-    copyAttributes(oindex, nindex);
-    setAttrib(result, xts_IndexSymbol, nindex);
+  }
 
-    for(j=1; j<nc; j++) {
-      for(i=0; i<nr; i++) {
-        if(int_sc[j] == NA_INTEGER)
-          SET_STRING_ELT(result, i+j*nr, NA_STRING);
-        else
-          SET_STRING_ELT(result, i+j*nr, STRING_ELT(x, int_sr[i]-1 + ((int_sc[j]-1) * nrs)));
+  UNPROTECT(1);
+  return result;
+}
+
+/* Row selections in _do_subset_xts() are validated once, and then copied by
+ * one of these kernels. Source rows are 0-based.
+ *
+ *   ROWS_RANGE   rows first, first + 1, ..., copied with memcpy
+ *   ROWS_STRIDE  rows first, first + by, first + 2*by, ...
+ *   ROWS_RUNS    runs of consecutive rows, one memcpy per run
+ *   ROWS_INDEX   arbitrary rows, gathered one element at a time
+ *   ROWS_MASK    rows where a logical mask is TRUE, compacted in one pass
+ */
+enum { ROWS_RANGE, ROWS_STRIDE, ROWS_RUNS, ROWS_INDEX, ROWS_MASK };
+
+struct row_plan {
+  int kind;
+  R_xlen_t n;           /* number of selected rows */
+  R_xlen_t first;       /* ROWS_RANGE, ROWS_STRIDE */
+  R_xlen_t by;          /* ROWS_STRIDE */
+  const int *rows;      /* ROWS_INDEX (1-based) */
+  R_xlen_t nruns;       /* ROWS_RUNS */
+  int *run_from;        /* ROWS_RUNS: first source row of each run */
+  R_xlen_t *run_out;    /* ROWS_RUNS: output offset of each run, and n */
+  const int *mask;      /* ROWS_MASK */
+  R_xlen_t mask_len;    /* ROWS_MASK: elements of 'mask' to use */
+  R_xlen_t nblocks;     /* ROWS_MASK */
+  R_xlen_t *block_out;  /* ROWS_MASK: output offset of each block, and n */
+};
+
+/* use ROWS_RUNS when the average run is at least this long */
+#define MIN_RUN_LENGTH 4
+
+/* ROWS_MASK splits the mask into blocks of this many elements, so it can be
+ * compacted in parallel */
+#define MASK_BLOCK 4096
+
+/* minimum number of elements to copy before using multiple threads, and
+ * minimum number of rows (or runs) in a chunk of a column */
+#define PARALLEL_MIN_ELEMENTS 65536
+#define PARALLEL_MIN_CHUNK 4096
+
+static void
+xts_row_plan(SEXP sr, int nrs, struct row_plan *plan)
+{
+  R_xlen_t k, n;
+
+  memset(plan, 0, sizeof(struct row_plan));
+
+  if (TYPEOF(sr) == LGLSXP) {
+    /* count the selected rows and their offset in the output at the start
+     * of each block, so the output can be allocated up front and blocks
+     * can be compacted independently. Like which(), NA are not selected. */
+    const int *mask = LOGICAL(sr);
+    R_xlen_t len = xlength(sr), count = 0;
+    for (k = nrs; k < len; k++) {
+      if (mask[k] == 1)
+        error("'i' or 'j' out of range");
+    }
+    if (len > nrs)
+      len = nrs;
+
+    R_xlen_t b, nblocks = (len + MASK_BLOCK - 1) / MASK_BLOCK;
+    R_xlen_t *block_out = (R_xlen_t *) R_alloc(nblocks + 1, sizeof(R_xlen_t));
+    for (b = 0; b < nblocks; b++) {
+      R_xlen_t end = (b + 1) * MASK_BLOCK;
+      if (end > len)
+        end = len;
+      block_out[b] = count;
+      for (k = b * MASK_BLOCK; k < end; k++)
+        count += (mask[k] == 1);
+    }
+    block_out[nblocks] = count;
+
+    plan->kind = ROWS_MASK;
+    plan->n = count;
+    plan->mask = mask;
+    plan->mask_len = len;
+    plan->nblocks = nblocks;
+    plan->block_out = block_out;
+    return;
+  }
+
+  if (inherits(sr, "xts_rows")) {
+    int from = INTEGER(sr)[0], by = INTEGER(sr)[1];
+    n = INTEGER(sr)[2];
+    if (n > 0 && (from < 1 || by < 1 || from + (n - 1) * by > nrs))
+      error("'i' or 'j' out of range");
+    plan->kind = (by == 1) ? ROWS_RANGE : ROWS_STRIDE;
+    plan->n = n;
+    plan->first = from - 1;
+    plan->by = by;
+    return;
+  }
+
+  const int *rows = INTEGER(sr);
+  n = xlength(sr);
+
+  /* validate all rows up front, so the kernels don't need to check them,
+   * and count runs and check for a constant stride in the same pass */
+  R_xlen_t nruns = (n > 0);
+  int by = 1, regular = 1;
+  for (k = 0; k < n; k++) {
+    int row = rows[k];
+    if (row == NA_INTEGER)
+      error("'i' contains NA");
+    if (row < 1 || row > nrs)
+      error("'i' or 'j' out of range");
+    if (k == 1)
+      by = row - rows[0];
+    if (k > 0) {
+      nruns += (row != rows[k-1] + 1);
+      regular &= (row - rows[k-1] == by);
+    }
+  }
+
+  plan->n = n;
+  if (n == 0 || regular) {
+    plan->kind = (by == 1) ? ROWS_RANGE : ROWS_STRIDE;
+    plan->first = (n > 0) ? rows[0] - 1 : 0;
+    plan->by = by;
+  } else if (nruns * MIN_RUN_LENGTH <= n) {
+    plan->kind = ROWS_RUNS;
+    plan->nruns = nruns;
+    plan->run_from = (int *) R_alloc(nruns, sizeof(int));
+    plan->run_out = (R_xlen_t *) R_alloc(nruns + 1, sizeof(R_xlen_t));
+    R_xlen_t r = 0;
+    for (k = 0; k < n; k++) {
+      if (k == 0 || rows[k] != rows[k-1] + 1) {
+        plan->run_from[r] = rows[k] - 1;
+        plan->run_out[r] = k;
+        r++;
       }
     }
-  } else
-  if(TYPEOF(x)==RAWSXP) {
-    /*
-    real_x = REAL(x);
-    real_result = REAL(result);
-    */
-    if(TYPEOF(nindex)==INTSXP) {
-      int_nindex = INTEGER(nindex);
-      int_oindex = INTEGER(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        int_nindex[i] = int_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          RAW(result)[i+j*nr] = 0;
-        else
-          RAW(result)[i+j*nr] = RAW(x)[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+    plan->run_out[nruns] = n;
+  } else {
+    plan->kind = ROWS_INDEX;
+    plan->rows = rows;
+  }
+}
+
+/* Number of units of work in a column: runs for ROWS_RUNS, blocks for
+ * ROWS_MASK, and rows otherwise */
+static R_xlen_t
+plan_units(const struct row_plan *plan)
+{
+  switch (plan->kind) {
+    case ROWS_RUNS:
+      return plan->nruns;
+    case ROWS_MASK:
+      return plan->nblocks;
+    default:
+      return plan->n;
+  }
+}
+
+/* Offset in the output of the first row of unit 'u' */
+static R_xlen_t
+plan_offset(const struct row_plan *plan, R_xlen_t u)
+{
+  switch (plan->kind) {
+    case ROWS_RUNS:
+      return plan->run_out[u];
+    case ROWS_MASK:
+      return plan->block_out[u];
+    default:
+      return u;
+  }
+}
+
+/* Gather the rows for units [lo, hi) of a column (see plan_units()) from
+ * 'src' into 'dst'. Elements are 'size' bytes. These don't call the R API,
+ * so they can be run on multiple threads.
+ *
+ * The mask kernel is branchless: it stores every element and only advances
+ * the output position for selected rows. It stops at the last selected row
+ * in [lo, hi), so it never stores past this chunk's part of 'dst'.
+ */
+#define GATHER_ROWS(TYPE)                                       \
+  do {                                                          \
+    const TYPE *s = (const TYPE *) src;                         \
+    TYPE *d = (TYPE *) dst;                                     \
+    if (plan->kind == ROWS_STRIDE) {                            \
+      const TYPE *sp = s + plan->first;                         \
+      R_xlen_t by = plan->by;                                   \
+      for (k = lo; k < hi; k++)                                 \
+        d[k] = sp[k * by];                                      \
+    } else if (plan->kind == ROWS_MASK) {                       \
+      const int *mask = plan->mask;                             \
+      R_xlen_t o = plan->block_out[lo];                         \
+      R_xlen_t from = lo * MASK_BLOCK, to = hi * MASK_BLOCK;    \
+      if (to > plan->mask_len)                                  \
+        to = plan->mask_len;                                    \
+      while (to > from && mask[to-1] != 1)                      \
+        to--;                                                   \
+      for (k = from; k < to; k++) {                             \
+        d[o] = s[k];                                            \
+        o += (mask[k] == 1);                                    \
+      }                                                         \
+    } else {                                                    \
+      const int *rows = plan->rows;                             \
+      for (k = lo; k < hi; k++)                                 \
+        d[k] = s[rows[k] - 1];                                  \
+    }                                                           \
+  } while (0)
+
+static void
+gather_rows(const char *src, char *dst, size_t size,
+            const struct row_plan *plan, R_xlen_t lo, R_xlen_t hi)
+{
+  R_xlen_t k;
+
+  switch (plan->kind) {
+    case ROWS_RANGE:
+      memcpy(dst + lo * size, src + (plan->first + lo) * size,
+             (hi - lo) * size);
+      return;
+    case ROWS_RUNS:
+      for (k = lo; k < hi; k++) {
+        R_xlen_t from = plan->run_out[k], len = plan->run_out[k+1] - from;
+        memcpy(dst + from * size, src + plan->run_from[k] * size, len * size);
       }
-    } else
-    if(TYPEOF(nindex)==REALSXP) {
-      real_nindex = REAL(nindex);
-      real_oindex = REAL(oindex);
-      for(i=0; i<nr; i++) {
-        if(int_sr[i] == NA_INTEGER)
-          error("'i' contains NA");
-        if(int_sr[i] > nrs || int_sc[j] > ncs)
-          error("'i' or 'j' out of range");
-        real_nindex[i] = real_oindex[int_sr[i]-1];
-        if(int_sc[j] == NA_INTEGER)
-          RAW(result)[i+j*nr] = 0;
-        else
-          RAW(result)[i+j*nr] = RAW(x)[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+      return;
+  }
+
+  switch (size) {
+    case sizeof(Rbyte):
+      GATHER_ROWS(Rbyte);
+      break;
+    case sizeof(int):
+      GATHER_ROWS(int);
+      break;
+    case sizeof(double):
+      GATHER_ROWS(double);
+      break;
+    case sizeof(Rcomplex):
+      GATHER_ROWS(Rcomplex);
+      break;
+  }
+}
+
+#undef GATHER_ROWS
+
+/* Fill elements [lo, hi) of 'dst' with NA for type 'type' */
+static void
+fill_na(char *dst, int type, R_xlen_t lo, R_xlen_t hi)
+{
+  R_xlen_t k;
+
+  switch (type) {
+    case LGLSXP:
+    case INTSXP:
+      for (k = lo; k < hi; k++)
+        ((int *) dst)[k] = NA_INTEGER;
+      break;
+    case REALSXP:
+      for (k = lo; k < hi; k++)
+        ((double *) dst)[k] = NA_REAL;
+      break;
+    case CPLXSXP:
+      for (k = lo; k < hi; k++) {
+        ((Rcomplex *) dst)[k].r = NA_REAL;
+        ((Rcomplex *) dst)[k].i = NA_REAL;
       }
-    }
-    copyAttributes(oindex, nindex);
-    setAttrib(result, xts_IndexSymbol, nindex);
+      break;
+    case RAWSXP:
+      memset(dst + lo, 0, hi - lo);
+      break;
+  }
+}
 
-    for(j=1; j<nc; j++) {
-      for(i=0; i<nr; i++) {
-        if(int_sc[j] == NA_INTEGER)
-          RAW(result)[i+j*nr] = 0;
-        else
-          RAW(result)[i+j*nr] = RAW(x)[int_sr[i]-1 + ((int_sc[j]-1) * nrs)];
+/* Copy the selected rows of column 'col' of a character 'x' into column
+ * 'j' of 'result'. A NA 'col' fills the column with NA.
+ */
+static void
+gather_strings(SEXP x, SEXP result, int col, int j, int nrs,
+               const struct row_plan *plan)
+{
+  R_xlen_t k, r, n = plan->n;
+  R_xlen_t xoff = (R_xlen_t) (col - 1) * nrs, roff = (R_xlen_t) j * n;
+
+  if (col == NA_INTEGER) {
+    for (k = 0; k < n; k++)
+      SET_STRING_ELT(result, roff + k, NA_STRING);
+    return;
+  }
+
+  switch (plan->kind) {
+    case ROWS_RANGE:
+    case ROWS_STRIDE:
+      for (k = 0; k < n; k++)
+        SET_STRING_ELT(result, roff + k,
+                       STRING_ELT(x, xoff + plan->first + k * plan->by));
+      break;
+    case ROWS_RUNS:
+      for (r = 0; r < plan->nruns; r++) {
+        R_xlen_t from = plan->run_from[r];
+        for (k = plan->run_out[r]; k < plan->run_out[r+1]; k++)
+          SET_STRING_ELT(result, roff + k, STRING_ELT(x, xoff + from++));
       }
+      break;
+    case ROWS_INDEX:
+      for (k = 0; k < n; k++)
+        SET_STRING_ELT(result, roff + k,
+                       STRING_ELT(x, xoff + plan->rows[k] - 1));
+      break;
+    case ROWS_MASK:
+      for (k = 0, r = 0; k < plan->mask_len; k++) {
+        if (plan->mask[k] == 1)
+          SET_STRING_ELT(result, roff + r++, STRING_ELT(x, xoff + k));
+      }
+      break;
+  }
+}
+
+static size_t
+xts_elt_size(int type)
+{
+  switch (type) {
+    case LGLSXP:
+      return sizeof(int);
+    case INTSXP:
+      return sizeof(int);
+    case REALSXP:
+      return sizeof(double);
+    case CPLXSXP:
+      return sizeof(Rcomplex);
+    case RAWSXP:
+      return sizeof(Rbyte);
+    default:
+      error("unsupported type");
+  }
+  return 0;
+}
+
+static char *
+xts_data_ptr(SEXP x)
+{
+  switch (TYPEOF(x)) {
+    case LGLSXP:
+      return (char *) LOGICAL(x);
+    case INTSXP:
+      return (char *) INTEGER(x);
+    case REALSXP:
+      return (char *) REAL(x);
+    case CPLXSXP:
+      return (char *) COMPLEX(x);
+    case RAWSXP:
+      return (char *) RAW(x);
+    default:
+      error("unsupported type");
+  }
+  return NULL;
+}
+
+/* Copy the selected rows of columns 'sc' of 'x' into 'result', and of
+ * 'oindex' into 'nindex' (unless 'nindex' is NULL). Every column (including
+ * the index) is split into chunks when there are fewer columns than threads,
+ * so both wide and long subsets are spread across threads.
+ */
+static void
+subset_xts_rows(SEXP x, SEXP result, SEXP oindex, SEXP nindex,
+                const struct row_plan *plan, SEXP sc)
+{
+  int j, nrs = nrows(x), nc = length(sc);
+  int *int_sc = INTEGER(sc);
+  int type = TYPEOF(x), string = (type == STRSXP);
+  R_xlen_t n = plan->n;
+
+  /* the index is copied as one more column */
+  int with_index = (nindex != R_NilValue);
+  int ncol = (string ? 0 : nc) + with_index;
+  const char **src = (const char **) R_alloc(ncol, sizeof(char *));
+  char **dst = (char **) R_alloc(ncol, sizeof(char *));
+  size_t *size = (size_t *) R_alloc(ncol, sizeof(size_t));
+  int *na_type = (int *) R_alloc(ncol, sizeof(int));
+
+  if (!string) {
+    size_t xsize = xts_elt_size(type);
+    const char *x_ptr = xts_data_ptr(x);
+    char *result_ptr = xts_data_ptr(result);
+    for (j = 0; j < nc; j++) {
+      src[j] = (int_sc[j] == NA_INTEGER) ? NULL :
+        x_ptr + (R_xlen_t) (int_sc[j] - 1) * nrs * xsize;
+      dst[j] = result_ptr + (R_xlen_t) j * n * xsize;
+      size[j] = xsize;
+      na_type[j] = type;
+    }
+  } else {
+    for (j = 0; j < nc; j++)
+      gather_strings(x, result, int_sc[j], j, nrs, plan);
+  }
+
+  if (TYPEOF(oindex) != INTSXP && TYPEOF(oindex) != REALSXP)
+    error("unsupported index type");
+  if (with_index) {
+    /* ALTREP indexes are read without storing their values */
+    src[ncol-1] = (TYPEOF(oindex) == REALSXP) ?
+      (const char *) xts_real_values(oindex) : xts_data_ptr(oindex);
+    dst[ncol-1] = xts_data_ptr(nindex);
+    size[ncol-1] = xts_elt_size(TYPEOF(oindex));
+    na_type[ncol-1] = TYPEOF(oindex);
+  }
+  if (ncol == 0)
+    return;
+
+  R_xlen_t units = plan_units(plan);
+  R_xlen_t min_chunk = (plan->kind == ROWS_MASK) ? 1 : PARALLEL_MIN_CHUNK;
+  int nthreads = 1, nchunks = 1;
+  if (n * ncol >= PARALLEL_MIN_ELEMENTS)
+    nthreads = xts_get_num_threads();
+  if (nthreads > 1 && ncol < nthreads) {
+    nchunks = (nthreads + ncol - 1) / ncol;
+    if (units / nchunks < min_chunk)
+      nchunks = (units / min_chunk > 0) ? units / min_chunk : 1;
+  }
+  int t, ntasks = ncol * nchunks;
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) schedule(dynamic) if(nthreads > 1 && ntasks > 1)
+#endif
+  for (t = 0; t < ntasks; t++) {
+    int jj = t / nchunks, c = t % nchunks;
+    R_xlen_t lo = units * c / nchunks, hi = units * (c + 1) / nchunks;
+    if (src[jj] == NULL) {
+      fill_na(dst[jj], na_type[jj], plan_offset(plan, lo),
+              plan_offset(plan, hi));
+    } else {
+      gather_rows(src[jj], dst[jj], size[jj], plan, lo, hi);
     }
   }
+}
+
+SEXP _do_subset_xts (SEXP x, SEXP sr, SEXP sc, SEXP drop) {
+  SEXP result;
+  int j, nr, nc, nrs, ncs;
+  int P=0;
+
+  SEXP Dim = getAttrib(x, R_DimSymbol);
+  nrs = nrows(x);ncs = ncols(x);
+  nc = length(sc);
+
+  /* validate rows and columns once, and choose a kernel for the rows */
+  struct row_plan plan;
+  xts_row_plan(sr, nrs, &plan);
+  nr = plan.n;
+
+  int *int_sc = INTEGER(sc);
+  for(j=0; j<nc; j++) {
+    if(int_sc[j] != NA_INTEGER && (int_sc[j] < 1 || int_sc[j] > ncs))
+      error("'i' or 'j' out of range");
+  }
+
+  SEXP oindex, nindex;
+  struct regular_index regular;
+  oindex = getAttrib(x, xts_IndexSymbol);
+  /* evenly spaced rows of a compact index are compact, and the index values
+   * don't need to be copied */
+  int compact = (plan.kind == ROWS_RANGE || plan.kind == ROWS_STRIDE) &&
+    plan.by > 0 && nr > 1 && xts_regular_index(oindex, &regular);
+  if (compact) {
+    regular.first += plan.first * regular.by;
+    regular.by *= plan.by;
+    regular.n = nr;
+    PROTECT(nindex = xts_new_regular_index(&regular)); P++;
+  } else {
+    PROTECT(nindex = allocVector(TYPEOF(oindex), nr)); P++;
+  }
+  PROTECT(result = allocVector(TYPEOF(x), (R_xlen_t)nr*nc)); P++;
+
+  copyAttributes(x, result);
+
+  subset_xts_rows(x, result, oindex, compact ? R_NilValue : nindex, &plan, sc);
+  copyAttributes(oindex, nindex);
+  setAttrib(result, xts_IndexSymbol, nindex);
 
 
   if(!isNull(Dim) && nr >= 0 && nc >= 0) {
@@ -428,11 +863,12 @@ SEXP _do_subset_xts (SEXP x, SEXP sr, SEXP sc, SEXP drop) {
     dimnames = getAttrib(x, R_DimNamesSymbol);
     dimnamesnames = getAttrib(dimnames, R_NamesSymbol);
     if (!isNull(dimnames)) {
+        SEXP srows = PROTECT(xts_expand_rows(sr));
         PROTECT(newdimnames = allocVector(VECSXP, 2));
         if (TYPEOF(dimnames) == VECSXP) {
           SET_VECTOR_ELT(newdimnames, 0,
             xts_ExtractSubset(VECTOR_ELT(dimnames, 0),
-                  allocVector(STRSXP, nr), sr));
+                  allocVector(STRSXP, nr), srows));
           SET_VECTOR_ELT(newdimnames, 1,
             xts_ExtractSubset(VECTOR_ELT(dimnames, 1),
                   allocVector(STRSXP, nc), sc));
@@ -440,14 +876,14 @@ SEXP _do_subset_xts (SEXP x, SEXP sr, SEXP sc, SEXP drop) {
         else {
           SET_VECTOR_ELT(newdimnames, 0,
             xts_ExtractSubset(CAR(dimnames),
-                  allocVector(STRSXP, nr), sr));
+                  allocVector(STRSXP, nr), srows));
           SET_VECTOR_ELT(newdimnames, 1,
             xts_ExtractSubset(CADR(dimnames),
                   allocVector(STRSXP, nc), sc));
         }
         setAttrib(newdimnames, R_NamesSymbol, dimnamesnames);
         setAttrib(result, R_DimNamesSymbol, newdimnames);
-        UNPROTECT(1);
+        UNPROTECT(2);
     }
     }
 
@@ -461,3 +897,439 @@ SEXP _do_subset_xts (SEXP x, SEXP sr, SEXP sc, SEXP drop) {
   return result;
 }
 
+
+/* Scatter 'src' into the selected rows of a column 'dst'. 'src' has either
+ * one element per selected row, or a single element that is broadcast to
+ * every selected row ('broadcast' is nonzero). Elements are 'size' bytes.
+ */
+#define SCATTER_ROWS(TYPE)                                      \
+  do {                                                          \
+    const TYPE *s = (const TYPE *) src;                         \
+    TYPE *d = (TYPE *) dst;                                     \
+    R_xlen_t inc = !broadcast;                                  \
+    switch (plan->kind) {                                       \
+      case ROWS_RANGE:                                          \
+        for (k = 0; k < n; k++)                                 \
+          d[plan->first + k] = s[k * inc];                      \
+        break;                                                  \
+      case ROWS_STRIDE:                                         \
+        for (k = 0; k < n; k++)                                 \
+          d[plan->first + k * plan->by] = s[k * inc];           \
+        break;                                                  \
+      case ROWS_RUNS:                                           \
+        for (r = 0; r < plan->nruns; r++) {                     \
+          R_xlen_t row = plan->run_from[r];                     \
+          for (k = plan->run_out[r]; k < plan->run_out[r+1]; k++) \
+            d[row++] = s[k * inc];                              \
+        }                                                       \
+        break;                                                  \
+      case ROWS_INDEX:                                          \
+        for (k = 0; k < n; k++)                                 \
+          d[plan->rows[k] - 1] = s[k * inc];                    \
+        break;                                                  \
+      case ROWS_MASK:                                           \
+        for (k = 0, r = 0; k < plan->mask_len; k++) {           \
+          if (plan->mask[k] == 1)                               \
+            d[k] = s[inc * r++];                                \
+        }                                                       \
+        break;                                                  \
+    }                                                           \
+  } while (0)
+
+static void
+scatter_rows(char *dst, const char *src, size_t size, int broadcast,
+             const struct row_plan *plan)
+{
+  R_xlen_t k, r, n = plan->n;
+
+  /* contiguous rows are a single memcpy, or a memset when every byte of a
+   * broadcast value is the same (e.g. zero) */
+  if (plan->kind == ROWS_RANGE) {
+    if (!broadcast) {
+      memcpy(dst + plan->first * size, src, n * size);
+      return;
+    }
+    for (k = 1; k < (R_xlen_t) size && src[k] == src[0]; k++);
+    if (k == (R_xlen_t) size) {
+      memset(dst + plan->first * size, src[0], n * size);
+      return;
+    }
+  }
+
+  switch (size) {
+    case sizeof(Rbyte):
+      SCATTER_ROWS(Rbyte);
+      break;
+    case sizeof(int):
+      SCATTER_ROWS(int);
+      break;
+    case sizeof(double):
+      SCATTER_ROWS(double);
+      break;
+    case sizeof(Rcomplex):
+      SCATTER_ROWS(Rcomplex);
+      break;
+  }
+}
+
+#undef SCATTER_ROWS
+
+/* Assign 'value' to rows 'sr' and columns 'sc' of 'x', and return 'x'.
+ * 'x' is modified in place unless it may be shared, in which case it's
+ * copied first. 'sr' is anything xts_row_plan() accepts, or NULL for all
+ * rows. 'value' must have the same type as 'x' (see [<-.xts), and is
+ * recycled over the selected cells column by column.
+ */
+SEXP xts_assign_rows(SEXP x, SEXP sr, SEXP sc, SEXP value)
+{
+  int j, P = 0;
+  int nrs = nrows(x), ncs = ncols(x), nc = length(sc);
+  int *int_sc = INTEGER(sc);
+
+  if (TYPEOF(value) != TYPEOF(x))
+    error("'value' must have the same type as 'x'");
+
+  struct row_plan plan;
+  if (isNull(sr)) {
+    memset(&plan, 0, sizeof(struct row_plan));
+    plan.kind = ROWS_RANGE;
+    plan.n = nrs;
+  } else {
+    xts_row_plan(sr, nrs, &plan);
+  }
+
+  for (j = 0; j < nc; j++) {
+    if (int_sc[j] == NA_INTEGER || int_sc[j] < 1 || int_sc[j] > ncs)
+      error("'i' or 'j' out of range");
+  }
+
+  R_xlen_t k, n = plan.n, nv = xlength(value);
+  if (n == 0 || nc == 0)
+    return x;
+  if (nv == 0 || ((R_xlen_t) n * nc) % nv != 0)
+    error("number of items to replace is not a multiple of replacement length");
+
+  if (MAYBE_SHARED(x)) {
+    PROTECT(x = shallow_duplicate(x)); P++;
+  }
+
+  if (TYPEOF(x) == STRSXP) {
+    /* expand the rows, since SET_STRING_ELT() is needed for every cell */
+    SEXP rows = PROTECT(isNull(sr) ? R_NilValue : xts_expand_rows(sr)); P++;
+    const int *int_rows = isNull(rows) ? NULL : INTEGER(rows);
+    for (j = 0; j < nc; j++) {
+      R_xlen_t xoff = (R_xlen_t) (int_sc[j] - 1) * nrs, voff = j * n;
+      for (k = 0; k < n; k++) {
+        R_xlen_t row = (int_rows) ? int_rows[k] - 1 : k;
+        SET_STRING_ELT(x, xoff + row, STRING_ELT(value, (voff + k) % nv));
+      }
+    }
+    UNPROTECT(P);
+    return x;
+  }
+
+  size_t size = xts_elt_size(TYPEOF(x));
+  char *x_ptr = xts_data_ptr(x);
+  const char *v_ptr = xts_data_ptr(value);
+  char *buf = NULL;
+
+  for (j = 0; j < nc; j++) {
+    char *dst = x_ptr + (R_xlen_t) (int_sc[j] - 1) * nrs * size;
+    R_xlen_t voff = (j * n) % nv;
+    if (nv == 1) {
+      scatter_rows(dst, v_ptr, size, 1, &plan);
+    } else if (voff + n <= nv) {
+      scatter_rows(dst, v_ptr + voff * size, size, 0, &plan);
+    } else {
+      /* 'value' wraps around within this column */
+      if (buf == NULL)
+        buf = R_alloc(n, size);
+      for (k = 0; k < n; k++)
+        memcpy(buf + k * size, v_ptr + ((voff + k) % nv) * size, size);
+      scatter_rows(dst, buf, size, 0, &plan);
+    }
+  }
+
+  UNPROTECT(P);
+  return x;
+}
+
+/* Extract the rows first[k]:last[k] of 'x' for each window 'k'. Empty
+ * windows have first[k] > last[k]. Returns a list with one xts object per
+ * window when 'as_list' is true. Otherwise returns one xts object with the
+ * rows of every window and a "group" column containing the window number of
+ * each row. The rows are in index order, so windows that overlap or are not
+ * in order are interleaved, and rows in several windows are repeated in
+ * window order.
+ */
+SEXP xts_window_set(SEXP x, SEXP first, SEXP last, SEXP as_list)
+{
+  int j, k, P = 0;
+  int nw = length(first), nrs = nrows(x), nc = ncols(x);
+  int *int_first = INTEGER(first), *int_last = INTEGER(last);
+
+  if (length(last) != nw)
+    error("'first' and 'last' must have the same length");
+
+  /* window lengths, validated once */
+  int *len = (int *) R_alloc(nw, sizeof(int));
+  R_xlen_t total = 0;
+  for (k = 0; k < nw; k++) {
+    int f = int_first[k], l = int_last[k];
+    if (f == NA_INTEGER || l == NA_INTEGER)
+      error("window boundaries contain NA");
+    len[k] = (f <= l) ? l - f + 1 : 0;
+    if (len[k] > 0 && (f < 1 || l > nrs))
+      error("'i' or 'j' out of range");
+    total += len[k];
+  }
+
+  SEXP drop = PROTECT(ScalarLogical(0)); P++;
+
+  if (asLogical(as_list)) {
+    SEXP sc = PROTECT(allocVector(INTSXP, nc)); P++;
+    for (j = 0; j < nc; j++)
+      INTEGER(sc)[j] = j + 1;
+
+    SEXP result = PROTECT(allocVector(VECSXP, nw)); P++;
+    for (k = 0; k < nw; k++) {
+      SEXP rows = PROTECT(xts_row_range(int_first[k], 1, len[k]));
+      SET_VECTOR_ELT(result, k, _do_subset_xts(x, rows, sc, drop));
+      UNPROTECT(1);
+    }
+    UNPROTECT(P);
+    return result;
+  }
+
+  if (total > INT_MAX)
+    error("too many rows in the combined windows");
+
+  /* the rows of consecutive windows form runs, which _do_subset_xts()
+   * copies with one memcpy() per run and column. The extra NA column is
+   * filled with the group below. */
+  SEXP rows = PROTECT(allocVector(INTSXP, total)); P++;
+  int *int_rows = INTEGER(rows);
+  int *group = (int *) R_alloc(total, sizeof(int));
+  int sorted = 1, lo = nrs + 1, hi = 0;
+  R_xlen_t i = 0;
+  for (k = 0; k < nw; k++) {
+    if (len[k] == 0)
+      continue;
+    if (i > 0 && int_first[k] < int_rows[i - 1])
+      sorted = 0;
+    if (int_first[k] < lo) lo = int_first[k];
+    if (int_last[k] > hi) hi = int_last[k];
+    for (j = 0; j < len[k]; j++, i++) {
+      int_rows[i] = int_first[k] + j;
+      group[i] = k + 1;
+    }
+  }
+
+  if (!sorted) {
+    /* counting sort by row, which keeps the window order of repeated rows,
+     * so the index of the result is sorted */
+    int *pos = (int *) R_alloc((R_xlen_t) hi - lo + 2, sizeof(int));
+    memset(pos, 0, ((size_t) hi - lo + 2) * sizeof(int));
+    for (i = 0; i < total; i++)
+      pos[int_rows[i] - lo + 1]++;
+    for (j = 1; j <= hi - lo + 1; j++)
+      pos[j] += pos[j - 1];
+    int *by_row = (int *) R_alloc(total, sizeof(int));
+    int *by_group = (int *) R_alloc(total, sizeof(int));
+    for (i = 0; i < total; i++) {
+      int p = pos[int_rows[i] - lo]++;
+      by_row[p] = int_rows[i];
+      by_group[p] = group[i];
+    }
+    memcpy(int_rows, by_row, total * sizeof(int));
+    group = by_group;
+  }
+
+  SEXP sc = PROTECT(allocVector(INTSXP, nc + 1)); P++;
+  for (j = 0; j < nc; j++)
+    INTEGER(sc)[j] = j + 1;
+  INTEGER(sc)[nc] = NA_INTEGER;
+
+  SEXP result = PROTECT(_do_subset_xts(x, rows, sc, drop)); P++;
+
+  R_xlen_t off = (R_xlen_t) nc * total;
+  for (i = 0; i < total; i++) {
+    switch (TYPEOF(result)) {
+      case INTSXP:
+        INTEGER(result)[off + i] = group[i];
+        break;
+      case REALSXP:
+        REAL(result)[off + i] = group[i];
+        break;
+      case CPLXSXP:
+        COMPLEX(result)[off + i].r = group[i];
+        COMPLEX(result)[off + i].i = 0;
+        break;
+      case STRSXP:
+        {
+          char buf[16];
+          snprintf(buf, sizeof(buf), "%d", group[i]);
+          SET_STRING_ELT(result, off + i, mkChar(buf));
+        }
+        break;
+      default:
+        error("unsupported type");
+    }
+  }
+
+  /* name the group column */
+  SEXP dimnames = getAttrib(result, R_DimNamesSymbol);
+  SEXP colnames = isNull(dimnames) ? R_NilValue : VECTOR_ELT(dimnames, 1);
+  SEXP newnames = PROTECT(allocVector(STRSXP, nc + 1)); P++;
+  for (j = 0; j < nc; j++) {
+    SET_STRING_ELT(newnames, j,
+        isNull(colnames) ? mkChar("") : STRING_ELT(colnames, j));
+  }
+  SET_STRING_ELT(newnames, nc, mkChar("group"));
+  SEXP newdimnames = PROTECT(allocVector(VECSXP, 2)); P++;
+  if (!isNull(dimnames)) {
+    SET_VECTOR_ELT(newdimnames, 0, VECTOR_ELT(dimnames, 0));
+    setAttrib(newdimnames, R_NamesSymbol, getAttrib(dimnames, R_NamesSymbol));
+  }
+  SET_VECTOR_ELT(newdimnames, 1, newnames);
+  setAttrib(result, R_DimNamesSymbol, newdimnames);
+
+  UNPROTECT(P);
+  return result;
+}
+
+/* Fill 'ncell' cells of 'dst' from rows 'rows' of 'src' (0-based, negative
+ * for NA). These don't call the R API, so they can be run on multiple
+ * threads.
+ */
+#define GATHER_CELLS(TYPE, NA_VALUE)                            \
+  do {                                                          \
+    const TYPE *s = (const TYPE *) src;                         \
+    TYPE *d = (TYPE *) dst;                                     \
+    for (k = 0; k < ncell; k++)                                 \
+      d[k] = (rows[k] < 0) ? NA_VALUE : s[rows[k]];             \
+  } while (0)
+
+static void
+gather_cells(const char *src, char *dst, int type, const int *rows,
+             R_xlen_t ncell)
+{
+  R_xlen_t k;
+  Rcomplex na_complex;
+  na_complex.r = NA_REAL;
+  na_complex.i = NA_REAL;
+
+  switch (type) {
+    case LGLSXP:
+    case INTSXP:
+      GATHER_CELLS(int, NA_INTEGER);
+      break;
+    case REALSXP:
+      GATHER_CELLS(double, NA_REAL);
+      break;
+    case CPLXSXP:
+      GATHER_CELLS(Rcomplex, na_complex);
+      break;
+    case RAWSXP:
+      GATHER_CELLS(Rbyte, (Rbyte) 0);
+      break;
+  }
+}
+
+#undef GATHER_CELLS
+
+/* Aligned windows around each event time. Returns an array with dimensions
+ * (events, offsets, columns of 'x'), with NA where a window extends past the
+ * start or end of 'x'.
+ *
+ * When 'by_time' is false, 'offsets' are row offsets from the last row at
+ * or before each event (an as-of match). Offset 0 is that row; it's NA when
+ * the event is before the first row.
+ *
+ * When 'by_time' is true, 'offsets' are time offsets (in index units) from
+ * each event, and each cell is the last row at or before event + offset.
+ *
+ * All events (or event + offset times) are located with binsearch_many(),
+ * in one sweep over the index.
+ */
+SEXP xts_event_windows(SEXP x, SEXP events, SEXP offsets, SEXP by_time)
+{
+  int c, P = 0;
+  int nrs = nrows(x), nc = ncols(x);
+  R_xlen_t e, w, k, ne = xlength(events), nw = xlength(offsets);
+  R_xlen_t ncell = ne * nw;
+  SEXP index = getAttrib(x, xts_IndexSymbol);
+
+  if (TYPEOF(events) != REALSXP)
+    error("'events' must be double");
+
+  double *real_events = REAL(events);
+  int *rows = (int *) R_alloc(ncell > 0 ? ncell : 1, sizeof(int));
+  SEXP pos;
+
+  if (asLogical(by_time)) {
+    if (TYPEOF(offsets) != REALSXP)
+      error("'offsets' must be double");
+    double *real_offsets = REAL(offsets);
+    SEXP keys = PROTECT(allocVector(REALSXP, ncell)); P++;
+    double *real_keys = REAL(keys);
+    for (w = 0; w < nw; w++) {
+      for (e = 0; e < ne; e++)
+        real_keys[e + w * ne] = real_events[e] + real_offsets[w];
+    }
+    PROTECT(pos = binsearch_many(keys, index, ScalarLogical(0))); P++;
+    int *int_pos = INTEGER(pos);
+    for (k = 0; k < ncell; k++)
+      rows[k] = (int_pos[k] == NA_INTEGER) ? -1 : int_pos[k] - 1;
+  } else {
+    if (TYPEOF(offsets) != INTSXP)
+      error("'offsets' must be integer");
+    int *int_offsets = INTEGER(offsets);
+    PROTECT(pos = binsearch_many(events, index, ScalarLogical(0))); P++;
+    int *int_pos = INTEGER(pos);
+    for (e = 0; e < ne; e++) {
+      /* an event before the first row is aligned to row "0" */
+      int p = (int_pos[e] == NA_INTEGER) ? 0 : int_pos[e];
+      int valid = !ISNAN(real_events[e]);
+      for (w = 0; w < nw; w++) {
+        double row = (double) p - 1 + int_offsets[w];
+        rows[e + w * ne] =
+          (valid && row >= 0 && row < nrs) ? (int) row : -1;
+      }
+    }
+  }
+
+  SEXP result = PROTECT(alloc3DArray(TYPEOF(x), ne, nw, nc)); P++;
+
+  if (TYPEOF(x) == STRSXP) {
+    for (c = 0; c < nc; c++) {
+      R_xlen_t xoff = (R_xlen_t) c * nrs, roff = (R_xlen_t) c * ncell;
+      for (k = 0; k < ncell; k++) {
+        SET_STRING_ELT(result, roff + k, (rows[k] < 0) ? NA_STRING :
+                       STRING_ELT(x, xoff + rows[k]));
+      }
+    }
+    UNPROTECT(P);
+    return result;
+  }
+
+  int type = TYPEOF(x);
+  size_t size = xts_elt_size(type);
+  const char *x_ptr = xts_data_ptr(x);
+  char *result_ptr = xts_data_ptr(result);
+
+  int nthreads = 1;
+  if (nc > 1 && ncell * nc >= PARALLEL_MIN_ELEMENTS)
+    nthreads = xts_get_num_threads();
+
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(nthreads) if(nthreads > 1)
+#endif
+  for (c = 0; c < nc; c++) {
+    gather_cells(x_ptr + (R_xlen_t) c * nrs * size,
+                 result_ptr + (R_xlen_t) c * ncell * size, type, rows, ncell);
+  }
+
+  UNPROTECT(P);
+  return result;
+}
@@ -0,0 +1,54 @@
+/*
+#   xts: eXtensible time-series
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <R.h>
+#include <Rinternals.h>
+#include <stdlib.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "xts.h"
+
+/* threads used when neither 'xts.threads' nor OMP_NUM_THREADS is set */
+#define XTS_DEFAULT_THREADS 2
+
+/* Number of threads to use in parallel loops. This is the 'xts.threads'
+ * option when it is a positive number, the OpenMP default when the
+ * OMP_NUM_THREADS environment variable is set, and at most 2 otherwise, so
+ * xts does not take every core unless asked to. Always 1 when xts was
+ * built without OpenMP support.
+ *
+ * Must be called from the main thread, before entering a parallel region.
+ */
+int xts_get_num_threads(void)
+{
+#ifdef _OPENMP
+  int nthreads = omp_get_max_threads();
+  const char *env = getenv("OMP_NUM_THREADS");
+  if ((env == NULL || *env == '\0') && nthreads > XTS_DEFAULT_THREADS)
+    nthreads = XTS_DEFAULT_THREADS;
+  SEXP opt = GetOption1(install("xts.threads"));
+  if (!isNull(opt)) {
+    int n = asInteger(opt);
+    if (n != NA_INTEGER && n > 0)
+      nthreads = n;
+  }
+  return (nthreads > 0) ? nthreads : 1;
+#else
+  return 1;
+#endif
+}
@@ -47,6 +47,9 @@
 #include <R.h>
 #include <Rinternals.h>
 /*#include <Rdefines.h>*/
+#include <string.h>
+#include <limits.h>
+#include <math.h>
 #include "xts.h"
 
 #ifndef MAX
@@ -57,7 +60,58 @@
 #define MIN(a,b) (a < b ? a : b)
 #endif
 
-SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP hasAdjusted, SEXP first, SEXP colnames)
+/* Optional columns after OHLC(V)(A), computed in the same scan. The VWAP
+ * and TWAP are of the Close column; the TWAP weights each price by the
+ * time to the next observation in the period.
+ *
+ * With BAR_NA_RM, NA values are skipped instead of removing the rows that
+ * have them beforehand: Open, Close and Adjusted are the first and last
+ * non-NA values of their columns, High, Low and Volume ignore NA, and the
+ * optional columns only use observations with a Close. */
+enum { BAR_VWAP = 1, BAR_TWAP = 2, BAR_COUNT = 4, BAR_NA_RM = 8 };
+
+struct bar_stats {
+  long double pv, v;      /* sum of price * volume, and of volume */
+  long double tw, w;      /* sum of price * time held, and of time */
+  double prev_p, prev_t;
+  int n;
+};
+
+static inline void
+bar_stats_add(struct bar_stats *s, double p, double v, double t)
+{
+  if (s->n > 0) {
+    double dt = t - s->prev_t;
+    s->tw += s->prev_p * dt;
+    s->w += dt;
+  }
+  s->pv += p * v;
+  s->v += v;
+  s->prev_p = p;
+  s->prev_t = t;
+  s->n++;
+}
+
+/* Time of observation 'j', for the TWAP weights. A nanosecond (integer64)
+ * index is read as seconds since the first observation 'start' of the
+ * period, so the differences are exact. */
+struct bar_index {
+  const int *i;
+  const double *d;
+  const int64_t *ns;
+};
+
+static inline double
+bar_time(const struct bar_index *bi, int j, int start)
+{
+  if(bi->ns)
+    return (double)(bi->ns[j] - bi->ns[start]) / 1e9;
+  return bi->i ? (double)bi->i[j] : bi->d[j];
+}
+
+static SEXP
+ohlc_period(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume,
+            SEXP hasAdjusted, SEXP first, SEXP colnames, int stats)
 {
   SEXP result, ohlc, xindex, newindex, dimnames;
 
@@ -79,13 +133,23 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
 
   if(INTEGER(hasVolume)[0]) ncr++; /* Volume */
   if(INTEGER(hasAdjusted)[0]) ncr++; /* Adjusted (Yahoo) */
+  int ncs = ncr; /* first column of the optional columns */
+  int narm = stats & BAR_NA_RM;
+  stats &= ~BAR_NA_RM;
+  if(stats & BAR_VWAP) ncr++;
+  if(stats & BAR_TWAP) ncr++;
+  if(stats & BAR_COUNT) ncr++;
+  if((stats & BAR_VWAP) && !INTEGER(hasVolume)[0])
+    error("VWAP needs a Volume column");
 
   /* handle index values in xts */
   PROTECT(xindex = getAttrib(x, xts_IndexSymbol)); P++;
   int index_mode = TYPEOF(xindex);
   PROTECT(newindex = allocVector(index_mode, n)); P++;
   
-  PROTECT(result = allocVector(mode, n * ncr )); P++;
+  /* averages of integer prices are not integers */
+  int rmode = (stats & (BAR_VWAP | BAR_TWAP)) ? REALSXP : mode;
+  PROTECT(result = allocVector(rmode, n * ncr )); P++;
   PROTECT(ohlc = allocVector(mode, 6)); P++;
 
   int _FIRST = (INTEGER(first)[0]);
@@ -99,17 +163,27 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
   switch(mode) {
     case INTSXP:
       ohlc_int = INTEGER(ohlc);
-      result_int = INTEGER(result);
       x_int    = INTEGER(x);
       break;
     case REALSXP:
       ohlc_real = REAL(ohlc);
-      result_real = REAL(result);
       x_real    = REAL(x);
       break;
     default:
       error("unsupported type");
    }
+  if(rmode == INTSXP)
+    result_int = INTEGER(result);
+  else
+    result_real = REAL(result);
+  struct bar_index bi = { NULL, NULL, NULL };
+  if(index_mode == INTSXP)
+    bi.i = INTEGER(xindex);
+  else if(stats && xts_is_integer64(xindex))
+    bi.ns = (const int64_t *) REAL(xindex);
+  else if(index_mode == REALSXP)
+    bi.d = REAL(xindex);
+  struct bar_stats bs;
    
   int *_endpoints  = INTEGER(endpoints);
   int _hasAdjusted = INTEGER(hasAdjusted)[0]; 
@@ -120,6 +194,8 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
 
   for(i = 0; i < n; i++) {
     j = _endpoints[i];
+    int start = j;
+    memset(&bs, 0, sizeof(bs));
 
     if(_FIRST) {
       switch(index_mode) {
@@ -131,8 +207,68 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
           break;
       }
     }
+    if(narm) {
+      /* one pass that skips NA, so 'x' needs no na.omit() copy */
+      int end = _endpoints[i+1];
+      switch(mode) {
+        case INTSXP:
+          ohlc_int[0] = ohlc_int[1] = ohlc_int[2] = NA_INTEGER;
+          ohlc_int[3] = ohlc_int[5] = NA_INTEGER;
+          ohlc_int[4] = 0;
+          for( ; j < end; j++) {
+            int v;
+            if(ohlc_int[0] == NA_INTEGER)
+              ohlc_int[0] = x_int[j];                           /* Op */
+            if((v = x_int[j + Hi*nrx]) != NA_INTEGER)
+              ohlc_int[1] = (ohlc_int[1] == NA_INTEGER) ? v : MAX(ohlc_int[1], v);
+            if((v = x_int[j + Lo*nrx]) != NA_INTEGER)
+              ohlc_int[2] = (ohlc_int[2] == NA_INTEGER) ? v : MIN(ohlc_int[2], v);
+            if(_hasVolume && (v = x_int[j + Vo*nrx]) != NA_INTEGER)
+              ohlc_int[4] = ohlc_int[4] + v;                    /* Vo */
+            if(_hasAdjusted && (v = x_int[j + 5*nrx]) != NA_INTEGER)
+              ohlc_int[5] = v;                                  /* Ad */
+            if((v = x_int[j + Cl*nrx]) != NA_INTEGER) {
+              ohlc_int[3] = v;                                  /* Cl */
+              if(stats) {
+                int vo = _hasVolume ? x_int[j + Vo*nrx] : 0;
+                bar_stats_add(&bs, (double)v,
+                              vo == NA_INTEGER ? 0 : (double)vo,
+                              bar_time(&bi, j, start));
+              }
+            }
+          }
+          break;
+        case REALSXP:
+          ohlc_real[0] = ohlc_real[1] = ohlc_real[2] = NA_REAL;
+          ohlc_real[3] = ohlc_real[5] = NA_REAL;
+          ohlc_real[4] = 0;
+          for( ; j < end; j++) {
+            double v;
+            if(ISNAN(ohlc_real[0]))
+              ohlc_real[0] = x_real[j];                         /* Op */
+            if(!ISNAN(v = x_real[j + Hi*nrx]))
+              ohlc_real[1] = ISNAN(ohlc_real[1]) ? v : MAX(ohlc_real[1], v);
+            if(!ISNAN(v = x_real[j + Lo*nrx]))
+              ohlc_real[2] = ISNAN(ohlc_real[2]) ? v : MIN(ohlc_real[2], v);
+            if(_hasVolume && !ISNAN(v = x_real[j + Vo*nrx]))
+              ohlc_real[4] = ohlc_real[4] + v;                  /* Vo */
+            if(_hasAdjusted && !ISNAN(v = x_real[j + 5*nrx]))
+              ohlc_real[5] = v;                                 /* Ad */
+            if(!ISNAN(v = x_real[j + Cl*nrx])) {
+              ohlc_real[3] = v;                                 /* Cl */
+              if(stats) {
+                double vo = _hasVolume ? x_real[j + Vo*nrx] : 0;
+                bar_stats_add(&bs, v, ISNAN(vo) ? 0 : vo,
+                              bar_time(&bi, j, start));
+              }
+            }
+          }
+          break;
+      }
+    }
+
     /* set the Open, and initialize High, Low and Volume */
-    switch(mode) {
+    if(!narm) switch(mode) {
       case INTSXP:
         ohlc_int[0] = x_int[j];                                 /* Op */
         ohlc_int[1] = x_int[j + Hi*nrx];                        /* Hi */
@@ -150,13 +286,19 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
     }
 
     // set the High, Low, and Volume
-    switch(mode) {
+    if(!narm) switch(mode) {
       case INTSXP:
         for( ; j < _endpoints[i+1]; j++) {
           ohlc_int[1] = MAX(ohlc_int[1], x_int[j + Hi*nrx]);    /* HI */
           ohlc_int[2] = MIN(ohlc_int[2], x_int[j + Lo*nrx]);    /* LO */
           if(_hasVolume)
             ohlc_int[4] = ohlc_int[4] + x_int[j + Vo*nrx];      /* VO */
+          if(stats) {
+            int p = x_int[j + Cl*nrx], v = _hasVolume ? x_int[j + Vo*nrx] : 0;
+            bar_stats_add(&bs, p == NA_INTEGER ? NA_REAL : (double)p,
+                          v == NA_INTEGER ? NA_REAL : (double)v,
+                          bar_time(&bi, j, start));
+          }
         }
         break;
       case REALSXP:
@@ -166,6 +308,11 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
           if(_hasVolume) {
             ohlc_real[4] = ohlc_real[4] + x_real[j + Vo*nrx];   /* VO */
           }
+          if(stats) {
+            bar_stats_add(&bs, x_real[j + Cl*nrx],
+                          _hasVolume ? x_real[j + Vo*nrx] : 0,
+                          bar_time(&bi, j, start));
+          }
         }
         break;
     }
@@ -173,7 +320,7 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
     /* set the Close and Adjusted columns */
     /* Rprintf("i,j: %i,%i\t",i,j); */
     j--;
-    switch(mode) {
+    if(!narm) switch(mode) {
       case INTSXP:
         ohlc_int[3] = x_int[j + Cl*nrx];
         if(_hasAdjusted)
@@ -220,27 +367,34 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
         break;
     }
     */
-    switch(mode) {
-      case INTSXP:
-        result_int[i]     = ohlc_int[0];
-        result_int[i+1*n] = ohlc_int[1];
-        result_int[i+2*n] = ohlc_int[2];
-        result_int[i+3*n] = ohlc_int[3];
-        if(_hasVolume)
-          result_int[i+4*n] = ohlc_int[4];
-        if(_hasAdjusted)
-          result_int[i+5*n] = ohlc_int[5];
-        break;
-      case REALSXP:
-        result_real[i]     = ohlc_real[0];
-        result_real[i+1*n] = ohlc_real[1];
-        result_real[i+2*n] = ohlc_real[2];
-        result_real[i+3*n] = ohlc_real[3];
-        if(_hasVolume)
-          result_real[i+4*n] = ohlc_real[4];
-        if(_hasAdjusted)
-          result_real[i+5*n] = ohlc_real[5];
-        break;
+    /* Open, High, Low, Close[, Volume][, Adjusted] */
+    int cols[6], nc = 0;
+    cols[nc++] = 0; cols[nc++] = 1; cols[nc++] = 2; cols[nc++] = 3;
+    if(_hasVolume)
+      cols[nc++] = 4;
+    if(_hasAdjusted)
+      cols[nc++] = 5;
+    for(int c = 0; c < nc; c++) {
+      if(mode == REALSXP)
+        result_real[i+c*n] = ohlc_real[cols[c]];
+      else if(result_int)
+        result_int[i+c*n] = ohlc_int[cols[c]];
+      else
+        result_real[i+c*n] = (ohlc_int[cols[c]] == NA_INTEGER) ?
+                             NA_REAL : (double)ohlc_int[cols[c]];
+    }
+
+    int c = ncs;
+    if(stats & BAR_VWAP)
+      result_real[i+(c++)*n] = (bs.v != 0) ? (double)(bs.pv / bs.v) : NA_REAL;
+    if(stats & BAR_TWAP)  /* the price when the period has no duration */
+      result_real[i+(c++)*n] = (bs.w > 0) ? (double)(bs.tw / bs.w) :
+                               (bs.n > 0) ? bs.prev_p : NA_REAL;
+    if(stats & BAR_COUNT) {
+      if(result_int)
+        result_int[i+c*n] = bs.n;
+      else
+        result_real[i+c*n] = (double)bs.n;
     }
     /* Rprintf("i,j: %i,%i\n",i,j); */
 
@@ -263,10 +417,17 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
     SET_STRING_ELT(newcolnames, 1, mkChar("High"));
     SET_STRING_ELT(newcolnames, 2, mkChar("Low"));
     SET_STRING_ELT(newcolnames, 3, mkChar("Close"));
+    int c = 4;
     if(INTEGER(hasVolume)[0])
-      SET_STRING_ELT(newcolnames, 4, mkChar("Volume"));
+      SET_STRING_ELT(newcolnames, c++, mkChar("Volume"));
     if(INTEGER(hasAdjusted)[0])
-      SET_STRING_ELT(newcolnames, 5, mkChar("Adjusted"));
+      SET_STRING_ELT(newcolnames, c++, mkChar("Adjusted"));
+    if(stats & BAR_VWAP)
+      SET_STRING_ELT(newcolnames, c++, mkChar("VWAP"));
+    if(stats & BAR_TWAP)
+      SET_STRING_ELT(newcolnames, c++, mkChar("TWAP"));
+    if(stats & BAR_COUNT)
+      SET_STRING_ELT(newcolnames, c++, mkChar("Count"));
     SET_VECTOR_ELT(dimnames, 1, newcolnames);
   }
   setAttrib(result, R_DimNamesSymbol, dimnames);
@@ -279,3 +440,246 @@ SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP has
   UNPROTECT(P);
   return result;
 }
+
+SEXP toPeriod(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume, SEXP hasAdjusted, SEXP first, SEXP colnames)
+{
+  return ohlc_period(x, endpoints, hasVolume, whichVolume, hasAdjusted,
+                     first, colnames, 0);
+}
+
+/* toPeriod() with the optional "vwap", "twap" and "count" columns, and
+ * NA skipping when 'naRm' is TRUE */
+SEXP toPeriodStats(SEXP x, SEXP endpoints, SEXP hasVolume, SEXP whichVolume,
+                   SEXP hasAdjusted, SEXP first, SEXP colnames, SEXP stats,
+                   SEXP naRm)
+{
+  int flags = asLogical(naRm) == TRUE ? BAR_NA_RM : 0;
+  if(!isNull(stats) && TYPEOF(stats) != STRSXP)
+    error("'stats' must be a character vector");
+  for(int i = 0; i < length(stats); i++) {
+    const char *s = CHAR(STRING_ELT(stats, i));
+    if(0 == strcmp(s, "vwap"))       flags |= BAR_VWAP;
+    else if(0 == strcmp(s, "twap"))  flags |= BAR_TWAP;
+    else if(0 == strcmp(s, "count")) flags |= BAR_COUNT;
+    else error("unsupported bar statistic '%s'", s);
+  }
+  return ohlc_period(x, endpoints, hasVolume, whichVolume, hasAdjusted,
+                     first, colnames, flags);
+}
+
+/*
+ * Column-wise aggregation
+ *
+ * Each output column is an aggregation function applied to one column of
+ * 'x', so any number of columns can be aggregated over the same endpoints
+ * in one pass, without the fixed OHLC(V)(A) layout of toPeriod(). NA values
+ * are handled like the corresponding R functions without 'na.rm': they
+ * propagate to max, min, sum and mean, and are returned by first and last.
+ */
+int xts_aggregate_fun(const char *fun)
+{
+  if (0 == strcmp(fun, "first"))      return XTS_AGG_FIRST;
+  if (0 == strcmp(fun, "last"))       return XTS_AGG_LAST;
+  if (0 == strcmp(fun, "max"))        return XTS_AGG_MAX;
+  if (0 == strcmp(fun, "min"))        return XTS_AGG_MIN;
+  if (0 == strcmp(fun, "sum"))        return XTS_AGG_SUM;
+  if (0 == strcmp(fun, "count"))      return XTS_AGG_COUNT;
+  if (0 == strcmp(fun, "mean"))       return XTS_AGG_MEAN;
+  if (0 == strcmp(fun, "last.nonNA")) return XTS_AGG_LAST_NONNA;
+  error("unsupported aggregation function '%s'", fun);
+  return -1; /* not reached */
+}
+
+/* value of an integer or double column, with NA as NA_REAL */
+static inline double
+agg_value(const int *xi, const double *xr, R_xlen_t j)
+{
+  if (xr) return xr[j];
+  return (xi[j] == NA_INTEGER) ? NA_REAL : (double)xi[j];
+}
+
+/* 'fun' of rows [from, to) of one column */
+static double
+aggregate_rows(int fun, const int *xi, const double *xr, R_xlen_t from,
+               R_xlen_t to)
+{
+  R_xlen_t j;
+  double v, result;
+  long double sum;
+  int count;
+
+  switch (fun) {
+    case XTS_AGG_FIRST:
+      return agg_value(xi, xr, from);
+    case XTS_AGG_LAST:
+      return agg_value(xi, xr, to - 1);
+    case XTS_AGG_MAX:
+    case XTS_AGG_MIN:
+      result = agg_value(xi, xr, from);
+      for (j = from + 1; j < to && !ISNAN(result); j++) {
+        v = agg_value(xi, xr, j);
+        if (ISNAN(v) || (fun == XTS_AGG_MAX ? v > result : v < result))
+          result = v;
+      }
+      return result;
+    case XTS_AGG_SUM:
+    case XTS_AGG_MEAN:
+      sum = 0;
+      for (j = from; j < to; j++) {
+        sum += agg_value(xi, xr, j);
+      }
+      return (fun == XTS_AGG_SUM) ? (double)sum : (double)(sum / (to - from));
+    case XTS_AGG_COUNT:
+      count = 0;
+      for (j = from; j < to; j++) {
+        count += !ISNAN(agg_value(xi, xr, j));
+      }
+      return (double)count;
+    default: /* XTS_AGG_LAST_NONNA */
+      for (j = to - 1; j >= from; j--) {
+        v = agg_value(xi, xr, j);
+        if (!ISNAN(v)) return v;
+      }
+      return NA_REAL;
+  }
+}
+
+/* Running aggregation of one column, for bar builders. The results are the
+ * same as aggregate_rows() on the values passed to xts_agg_start() and
+ * xts_agg_add(). */
+void xts_agg_start(struct xts_agg_state *s, double v)
+{
+  s->first = s->last = s->max = s->min = v;
+  s->last_nonna = v;
+  s->sum = v;
+  s->count = !ISNAN(v);
+  s->nobs = 1;
+}
+
+void xts_agg_add(struct xts_agg_state *s, double v)
+{
+  s->last = v;
+  if (!ISNAN(s->max) && (ISNAN(v) || v > s->max)) s->max = v;
+  if (!ISNAN(s->min) && (ISNAN(v) || v < s->min)) s->min = v;
+  s->sum += v;
+  if (!ISNAN(v)) {
+    s->last_nonna = v;
+    s->count++;
+  }
+  s->nobs++;
+}
+
+double xts_agg_value(const struct xts_agg_state *s, int fun)
+{
+  switch (fun) {
+    case XTS_AGG_FIRST:      return s->first;
+    case XTS_AGG_LAST:       return s->last;
+    case XTS_AGG_MAX:        return s->max;
+    case XTS_AGG_MIN:        return s->min;
+    case XTS_AGG_SUM:        return (double)s->sum;
+    case XTS_AGG_COUNT:      return (double)s->count;
+    case XTS_AGG_MEAN:       return (double)(s->sum / s->nobs);
+    default:                 return s->last_nonna;
+  }
+}
+
+/* Aggregate the n periods [ep[i], ep[i+1]) of the integer ('xi') or double
+ * ('xr') matrix with 'nrx' rows into the n x ncr integer or double result.
+ * Output column c is fun[c] of input column col[c] (1-based). Returns
+ * nonzero if an integer result overflowed, which is stored as NA. Does not
+ * use the R API, so it can run in parallel. */
+int xts_aggregate_periods(const int *xi, const double *xr, R_xlen_t nrx,
+                          const int *ep, int n, int ncr, const int *col,
+                          const int *fun, int *result_int, double *result_real)
+{
+  int overflow = 0;
+
+  for (int i = 0; i < n; i++) {
+    for (int c = 0; c < ncr; c++) {
+      R_xlen_t offset = (R_xlen_t)(col[c] - 1) * nrx;
+      double v = aggregate_rows(fun[c], xi ? xi + offset : NULL,
+                                xr ? xr + offset : NULL, ep[i], ep[i + 1]);
+      if (result_real) {
+        result_real[i + (R_xlen_t)c * n] = v;
+      } else if (ISNAN(v)) {
+        result_int[i + (R_xlen_t)c * n] = NA_INTEGER;
+      } else if (fabs(v) > INT_MAX) {
+        /* as sum() of integers */
+        result_int[i + (R_xlen_t)c * n] = NA_INTEGER;
+        overflow = 1;
+      } else {
+        result_int[i + (R_xlen_t)c * n] = (int)v;
+      }
+    }
+  }
+  return overflow;
+}
+
+SEXP period_aggregate(SEXP x, SEXP endpoints, SEXP columns, SEXP funs,
+                      SEXP first, SEXP colnames)
+{
+  int P = 0;
+  int mode = TYPEOF(x);
+  if (mode != INTSXP && mode != REALSXP && mode != LGLSXP)
+    error("unsupported type");
+  if (TYPEOF(endpoints) != INTSXP) error("'endpoints' must be integer");
+  if (TYPEOF(columns) != INTSXP || TYPEOF(funs) != STRSXP ||
+      length(columns) != length(funs))
+    error("invalid aggregation specification");
+
+  R_xlen_t nrx = nrows(x);
+  int ncx = ncols(x);
+  int ncr = length(columns);
+  int n = length(endpoints) - 1;
+  if (n < 0) n = 0;
+  const int *ep = INTEGER(endpoints);
+  const int *col = INTEGER(columns);
+
+  int *fun = (int *) R_alloc(ncr, sizeof(int));
+  int real_result = (mode == REALSXP);
+  for (int c = 0; c < ncr; c++) {
+    fun[c] = xts_aggregate_fun(CHAR(STRING_ELT(funs, c)));
+    if (col[c] == NA_INTEGER || col[c] < 1 || col[c] > ncx)
+      error("aggregation column %d is out of range", c + 1);
+    if (fun[c] == XTS_AGG_MEAN) real_result = 1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (ep[i] < 0 || ep[i] >= ep[i + 1] || ep[i + 1] > nrx)
+      error("'endpoints' must be increasing row numbers");
+  }
+
+  const int *xi = (mode == REALSXP) ? NULL : INTEGER(x);
+  const double *xr = (mode == REALSXP) ? REAL(x) : NULL;
+
+  SEXP result = PROTECT(allocMatrix(real_result ? REALSXP : INTSXP, n, ncr)); P++;
+  int overflow = xts_aggregate_periods(xi, xr, nrx, ep, n, ncr, col, fun,
+                   real_result ? NULL : INTEGER(result),
+                   real_result ? REAL(result) : NULL);
+  if (overflow) warning("integer overflow - use sum(as.numeric(.))");
+
+  /* index of the first or last observation of each period */
+  SEXP xindex = PROTECT(getAttrib(x, xts_IndexSymbol)); P++;
+  int index_mode = TYPEOF(xindex);
+  SEXP newindex = PROTECT(allocVector(index_mode, n)); P++;
+  int at_first = asLogical(first) == TRUE;
+  for (int i = 0; i < n; i++) {
+    int j = at_first ? ep[i] : ep[i + 1] - 1;
+    if (index_mode == INTSXP) {
+      INTEGER(newindex)[i] = INTEGER(xindex)[j];
+    } else {
+      REAL(newindex)[i] = REAL(xindex)[j];
+    }
+  }
+
+  SEXP dimnames = PROTECT(allocVector(VECSXP, 2)); P++;
+  SET_VECTOR_ELT(dimnames, 1, colnames);
+  setAttrib(result, R_DimNamesSymbol, dimnames);
+  copyMostAttrib(xindex, newindex);
+  setAttrib(result, xts_IndexSymbol, newindex);
+
+  copy_xtsAttributes(x, result);
+  copy_xtsCoreAttributes(x, result);
+
+  UNPROTECT(P);
+  return result;
+}
@@ -0,0 +1,372 @@
+/*
+#   xts: eXtensible time-series
+#
+#   This program is free software: you can redistribute it and/or modify
+#   it under the terms of the GNU General Public License as published by
+#   the Free Software Foundation, either version 2 of the License, or
+#   (at your option) any later version.
+#
+#   This program is distributed in the hope that it will be useful,
+#   but WITHOUT ANY WARRANTY; without even the implied warranty of
+#   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#   GNU General Public License for more details.
+#
+#   You should have received a copy of the GNU General Public License
+#   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Reader for TZif (zoneinfo) files, RFC 8536.
+ *
+ * tzif_offsets() returns the UTC offset transition table used by the
+ * calendar kernels in endpoints.c: list(trans, offset), where offset[j]
+ * applies from trans[j] (UTC seconds) until trans[j+1], and trans[0] is
+ * -Inf. The explicit transitions of each file are parsed once and cached
+ * for the session. Times after the last explicit transition follow the
+ * POSIX TZ rule in the file's footer, which is expanded up to the end of
+ * the requested range.
+ *
+ * The cache is only read and written by tzif_offsets(), on the main thread.
+ * The returned table is an ordinary R object that worker threads only read.
+ */
+
+#include <R.h>
+#include <Rinternals.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "xts.h"
+
+/* Rule for one DST change in a POSIX TZ string: Jn, n, or Mm.w.d */
+struct tz_rule {
+  char type;      /* 'J', 'D' (zero-based day of year), or 'M' */
+  int day, week, mon;
+  long time;      /* local seconds after midnight, may be negative or > 24h */
+};
+
+struct tz_posix {
+  int valid;
+  int has_dst;
+  long std_off;   /* UTC offsets, in seconds east of UTC */
+  long dst_off;
+  struct tz_rule start, end;
+};
+
+struct tzif_zone {
+  char *path;
+  double *trans;  /* explicit transitions, UTC seconds */
+  double *offset; /* offset[j] applies from trans[j]; offset[0] before */
+  int n;          /* number of entries, trans[0] is -Inf */
+  struct tz_posix footer;
+  struct tzif_zone *next;
+};
+
+static struct tzif_zone *tzif_cache = NULL;
+
+/* rules are only expanded for these years */
+#define TZIF_MIN_YEAR 1900
+#define TZIF_MAX_YEAR 9999
+
+static int64_t read_be(const unsigned char *p, int size)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < size; i++) v = (v << 8) | p[i];
+  /* sign extend */
+  if (size < 8 && (v >> (8 * size - 1)) & 1) v |= ~(uint64_t)0 << (8 * size);
+  return (int64_t)v;
+}
+
+/*
+ * POSIX TZ string parsing, e.g. "EST5EDT,M3.2.0,M11.1.0"
+ */
+static const char *posix_name(const char *p)
+{
+  if (*p == '<') {
+    while (*p && *p != '>') p++;
+    return (*p == '>') ? p + 1 : NULL;
+  }
+  const char *s = p;
+  while (isalpha((unsigned char)*p)) p++;
+  return (p - s >= 3) ? p : NULL;
+}
+
+static const char *posix_hms(const char *p, long *secs)
+{
+  int sign = 1;
+  if (*p == '+' || *p == '-') sign = (*p++ == '-') ? -1 : 1;
+  if (!isdigit((unsigned char)*p)) return NULL;
+  long v[3] = { 0, 0, 0 };
+  for (int i = 0; i < 3; i++) {
+    if (!isdigit((unsigned char)*p)) return NULL;
+    while (isdigit((unsigned char)*p)) v[i] = v[i] * 10 + (*p++ - '0');
+    if (*p != ':' || i == 2) break;
+    p++;
+  }
+  *secs = sign * (v[0] * 3600 + v[1] * 60 + v[2]);
+  return p;
+}
+
+static const char *posix_rule(const char *p, struct tz_rule *r)
+{
+  long num = 0;
+  if (*p == 'J') {
+    r->type = 'J';
+    p++;
+  } else if (*p == 'M') {
+    r->type = 'M';
+    p++;
+    int v[3] = { 0, 0, 0 };
+    for (int i = 0; i < 3; i++) {
+      if (!isdigit((unsigned char)*p)) return NULL;
+      while (isdigit((unsigned char)*p)) v[i] = v[i] * 10 + (*p++ - '0');
+      if (i < 2 && *p++ != '.') return NULL;
+    }
+    r->mon = v[0]; r->week = v[1]; r->day = v[2];
+    if (r->mon < 1 || r->mon > 12 || r->week < 1 || r->week > 5 ||
+        r->day > 6)
+      return NULL;
+  } else {
+    r->type = 'D';
+  }
+  if (r->type != 'M') {
+    if (!isdigit((unsigned char)*p)) return NULL;
+    while (isdigit((unsigned char)*p)) num = num * 10 + (*p++ - '0');
+    r->day = (int)num;
+    if (r->day > 365 || (r->type == 'J' && r->day < 1)) return NULL;
+  }
+  r->time = 7200;
+  if (*p == '/') {
+    p = posix_hms(p + 1, &r->time);
+  }
+  return p;
+}
+
+static void posix_parse(const char *p, struct tz_posix *tz)
+{
+  long off;
+  memset(tz, 0, sizeof(*tz));
+
+  if (!(p = posix_name(p)) || !(p = posix_hms(p, &off))) return;
+  tz->std_off = -off;  /* POSIX offsets are positive west of UTC */
+  if (*p == '\0') {
+    tz->valid = 1;
+    return;
+  }
+
+  if (!(p = posix_name(p))) return;
+  tz->dst_off = tz->std_off + 3600;
+  if (*p != ',' && *p != '\0') {
+    if (!(p = posix_hms(p, &off))) return;
+    tz->dst_off = -off;
+  }
+  if (*p != ',') return;  /* no default rules */
+  if (!(p = posix_rule(p + 1, &tz->start)) || *p != ',') return;
+  if (!(p = posix_rule(p + 1, &tz->end)) || *p != '\0') return;
+  tz->has_dst = 1;
+  tz->valid = 1;
+}
+
+/* UTC time of 'rule' in 'year', when the local offset before it is 'off' */
+static double tz_rule_time(const struct tz_rule *r, int64_t year, long off)
+{
+  int64_t day;
+  switch (r->type) {
+    case 'J':  /* 1..365, February 29 is never counted */
+      day = xts_days_from_civil(year, 1, 1) + r->day - 1;
+      if (xts_days_in_month(year, 2) == 29 && r->day >= 60) day++;
+      break;
+    case 'D':  /* 0..365 */
+      day = xts_days_from_civil(year, 1, 1) + r->day;
+      break;
+    default: { /* day 'd' of week 'w' of month 'm'; week 5 is the last */
+      int64_t first = xts_days_from_civil(year, r->mon, 1);
+      int64_t next = xts_days_from_civil(year, r->mon + 1, 1);
+      /* 1970-01-01 was a Thursday */
+      int wday = (int)(((first % 7) + 11) % 7);
+      day = first + (r->day - wday + 7) % 7 + 7 * (r->week - 1);
+      while (day >= next) day -= 7;
+      break;
+    }
+  }
+  return (double)day * 86400.0 + (double)r->time - (double)off;
+}
+
+static int64_t tz_year(double t)
+{
+  /* approximate civil year, only used to choose which years to expand */
+  return 1970 + (int64_t)floor(t / (365.2425 * 86400.0));
+}
+
+/*
+ * Parsing of TZif files
+ */
+
+/* The counts of the header at 'p': isutcnt, isstdcnt, leapcnt, timecnt,
+ * typecnt, charcnt. FALSE when one is negative, i.e. the file is corrupt. */
+static int tzif_counts(const unsigned char *p, int64_t cnt[6])
+{
+  for (int i = 0; i < 6; i++) {
+    cnt[i] = read_be(p + 20 + 4 * i, 4);
+    if (cnt[i] < 0) return 0;
+  }
+  return 1;
+}
+
+static struct tzif_zone *tzif_parse(const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (NULL == f) return NULL;
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  if (size < 44 || size > 16 * 1024 * 1024) {
+    fclose(f);
+    return NULL;
+  }
+  unsigned char *buf = (unsigned char *) R_alloc(size + 1, 1);
+  size_t got = fread(buf, 1, size, f);
+  fclose(f);
+  if ((long)got != size || memcmp(buf, "TZif", 4) != 0) return NULL;
+  buf[size] = '\0';
+
+  int version = buf[4];
+  const unsigned char *p = buf;
+  const unsigned char *end = buf + size;
+  int tsize = 4;
+
+  /* counts: isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt */
+  int64_t cnt[6];
+  if (!tzif_counts(p, cnt)) return NULL;
+
+  if (version >= '2') {
+    /* skip the version 1 data block and use the 64-bit one */
+    int64_t skip = 44 + cnt[3] * 5 + cnt[4] * 6 + cnt[5] + cnt[2] * 8 +
+                   cnt[1] + cnt[0];
+    if (skip < 44 || skip + 44 > size) return NULL;
+    p = buf + skip;
+    if (memcmp(p, "TZif", 4) != 0) return NULL;
+    if (!tzif_counts(p, cnt)) return NULL;
+    tsize = 8;
+  }
+
+  /* check the size of the data block before computing any pointer into it */
+  int64_t timecnt = cnt[3], typecnt = cnt[4], charcnt = cnt[5];
+  int64_t len = 44 + timecnt * (tsize + 1) + typecnt * 6 + charcnt +
+                cnt[2] * (tsize + 4) + cnt[1] + cnt[0];
+  if (typecnt < 1 || len > end - p) return NULL;
+  const unsigned char *times = p + 44;
+  const unsigned char *idx = times + timecnt * tsize;
+  const unsigned char *types = idx + timecnt;
+  const unsigned char *data_end = p + len;
+
+  struct tzif_zone *z = R_Calloc(1, struct tzif_zone);
+  z->path = R_Calloc(strlen(path) + 1, char);
+  strcpy(z->path, path);
+  z->trans = R_Calloc(timecnt + 1, double);
+  z->offset = R_Calloc(timecnt + 1, double);
+
+  /* times before the first transition use time type 0 */
+  z->trans[0] = R_NegInf;
+  z->offset[0] = (double)read_be(types, 4);
+  z->n = 1;
+  for (int64_t i = 0; i < timecnt; i++) {
+    int type = idx[i];
+    if (type >= typecnt) type = 0;
+    double off = (double)read_be(types + 6 * type, 4);
+    if (off == z->offset[z->n - 1]) continue;
+    z->trans[z->n] = (double)read_be(times + tsize * i, tsize);
+    z->offset[z->n] = off;
+    z->n++;
+  }
+
+  /* the footer is a POSIX TZ string between newlines */
+  if (version >= '2' && data_end < end && *data_end == '\n') {
+    const char *footer = (const char *)data_end + 1;
+    char *nl = strchr(footer, '\n');
+    if (nl) {
+      *nl = '\0';
+      posix_parse(footer, &z->footer);
+    }
+  }
+  return z;
+}
+
+/* Transition table of the zone in file '_path', covering UTC times up to
+ * '_to'. NULL when the file can not be read. */
+SEXP tzif_offsets(SEXP _path, SEXP _to)
+{
+  if (!isString(_path) || length(_path) != 1)
+    error("'path' must be a character string");
+  const char *path = CHAR(STRING_ELT(_path, 0));
+  double to = asReal(_to);
+
+  struct tzif_zone *z = tzif_cache;
+  while (z && strcmp(z->path, path) != 0) z = z->next;
+  if (NULL == z) {
+    z = tzif_parse(path);
+    if (NULL == z) return R_NilValue;
+    z->next = tzif_cache;
+    tzif_cache = z;
+  }
+
+  /* explicit transitions, then the footer rule from the year of the last
+   * explicit transition through the end of the range */
+  double last = z->trans[z->n - 1];
+  int64_t first_year = 0, last_year = -1;
+  if (z->footer.valid && z->footer.has_dst && R_FINITE(to)) {
+    first_year = R_FINITE(last) ? tz_year(last) - 1 : TZIF_MIN_YEAR;
+    if (first_year < TZIF_MIN_YEAR) first_year = TZIF_MIN_YEAR;
+    last_year = tz_year(to) + 1;
+    if (last_year > TZIF_MAX_YEAR) last_year = TZIF_MAX_YEAR;
+  }
+  R_xlen_t nrule = (last_year >= first_year) ? 2 * (last_year - first_year + 1)
+                                             : 0;
+
+  int P = 0;
+  SEXP _trans = PROTECT(allocVector(REALSXP, z->n + nrule + 1)); P++;
+  SEXP _offset = PROTECT(allocVector(REALSXP, z->n + nrule + 1)); P++;
+  double *trans = REAL(_trans), *offset = REAL(_offset);
+  memcpy(trans, z->trans, z->n * sizeof(double));
+  memcpy(offset, z->offset, z->n * sizeof(double));
+  R_xlen_t n = z->n;
+
+  const struct tz_posix *tz = &z->footer;
+  if (tz->valid && !tz->has_dst && tz->std_off != offset[n - 1]) {
+    trans[n] = R_FINITE(last) ? last + 1 : 0;
+    offset[n++] = (double)tz->std_off;
+  }
+  for (int64_t y = first_year; y <= last_year; y++) {
+    double t[2], off[2];
+    t[0] = tz_rule_time(&tz->start, y, tz->std_off);
+    off[0] = (double)tz->dst_off;
+    t[1] = tz_rule_time(&tz->end, y, tz->dst_off);
+    off[1] = (double)tz->std_off;
+    int a = (t[0] <= t[1]) ? 0 : 1;   /* southern hemisphere: end first */
+    for (int j = 0; j < 2; j++) {
+      int w = (j == 0) ? a : 1 - a;
+      if (t[w] < trans[n - 1]) continue;
+      if (t[w] == trans[n - 1]) {
+        /* e.g. DST all year: the end and the next start coincide */
+        offset[n - 1] = off[w];
+        if (n > 1 && offset[n - 1] == offset[n - 2]) n--;
+      } else if (off[w] != offset[n - 1]) {
+        trans[n] = t[w];
+        offset[n++] = off[w];
+      }
+    }
+  }
+
+  _trans = PROTECT(xlengthgets(_trans, n)); P++;
+  _offset = PROTECT(xlengthgets(_offset, n)); P++;
+  SEXP _result = PROTECT(allocVector(VECSXP, 2)); P++;
+  SET_VECTOR_ELT(_result, 0, _trans);
+  SET_VECTOR_ELT(_result, 1, _offset);
+  SEXP _names = PROTECT(allocVector(STRSXP, 2)); P++;
+  SET_STRING_ELT(_names, 0, mkChar("trans"));
+  SET_STRING_ELT(_names, 1, mkChar("offset"));
+  setAttrib(_result, R_NamesSymbol, _names);
+
+  UNPROTECT(P);
+  return _result;
+}